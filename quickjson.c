@@ -4,6 +4,26 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QJSON_X86 1
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define QJSON_IO_URING 1
+#endif
+#endif
+#endif
 
 #define BUFLEN (4*1024)
 
@@ -22,6 +42,7 @@ enum qjson_type {
     QJSON_FLOAT,
     QJSON_BOOL,
     QJSON_NULL,
+    QJSON_NUMBER,   /* number kept as its source text, converted on access */
 };
 typedef enum qjson_type qjson_type_t;
 
@@ -29,13 +50,51 @@ struct qjson_value;
 struct qjson_array;
 struct qjson_object;
 
+/*
+ * Strings shorter than QJSON_SSO_SIZE bytes are stored inline, longer ones
+ * on the heap. Which member is live follows from the length kept next to
+ * the buffer, so no flag is needed.
+ */
+#define QJSON_SSO_SIZE 16
+
+union qjson_strbuf {
+    char *heap;
+    char sso[QJSON_SSO_SIZE];
+};
+
+/*
+ * A QJSON_NUMBER keeps its text and, once it has been read as a number,
+ * the result. Text shorter than QJSON_NUMBER_INLINE bytes sits in the
+ * value; longer text is a heap copy, or with QJSON_PARSE_BORROW_INPUT a
+ * pointer into the parsed input. The top bits of len say which, and what
+ * is cached; the text never changes once the value is made.
+ */
+#define QJSON_NUMBER_INLINE 8
+#define QJSON_NUMBER_OWNED  0x80000000u     /* text is a copy, freed with the value */
+#define QJSON_NUMBER_CACHED 0x40000000u     /* cached holds the converted number */
+#define QJSON_NUMBER_INT64  0x20000000u     /* ... as integer; without it as fraction */
+#define QJSON_NUMBER_LEN    0x0fffffffu     /* bits of len that are the text length */
+
+struct qjson_number {
+    union {
+        const char *ptr;
+        char inline_text[QJSON_NUMBER_INLINE];
+    } text;
+    union {
+        int64_t integer;
+        double fraction;
+    } cached;
+};
+
 struct qjson_value {
     qjson_type_t json_type;
+    uint32_t len;               /* byte length of a QJSON_STRING; QJSON_NUMBER_* bits of a QJSON_NUMBER */
     union {
         int64_t integer;
         bool boolean;
         double fraction;
-        char *str;
+        union qjson_strbuf str;
+        struct qjson_number number;
         struct qjson_array *array;
         struct qjson_object *object;
     }v;
@@ -44,13 +103,59 @@ typedef struct qjson_value qjson_value_t;
 
 
 struct qjson_pair {
-    char *key;
+    uint32_t keylen;
+    union qjson_strbuf key;
     struct qjson_value value;
     struct qjson_pair *next;
 };
 typedef struct qjson_pair qjson_pair_t;
 
+/*
+ * Containers are reference counted so subtrees can be shared between
+ * documents and threads. A container referenced more than once is treated
+ * as immutable: the mutating functions copy it first.
+ *
+ * With QJSON_NODE_CACHE set a container keeps its serialized bytes in
+ * cache, one fragment per set of dump flags. Modifying it through the API
+ * drops that cache and the caches of its ancestors, found through parent;
+ * a container without cache is dirty and is formatted again on the next
+ * dump. Only a private container (and so only a private path) is ever
+ * invalidated, so no other thread can be reading the fragments freed.
+ *
+ * qjson_compact moves containers into a shared block. Such a container is
+ * frozen, so its members are never replaced in place, and gives its
+ * memory back only when the last container in the block is released.
+ */
+#define QJSON_NODE_CACHE    0x1
+#define QJSON_NODE_FROZEN   0x2     /* never modified in place again */
+
+/* containers that serialize shorter than this are not worth caching */
+#define QJSON_CACHE_MIN     64
+
+struct qjson_fragment {
+    struct qjson_fragment *next;    /* the same container dumped with other flags */
+    size_t len;
+    uint32_t flags;     /* QJSON_DUMP_* the bytes were written with */
+    char data[];
+};
+
+/* one allocation holding a compacted tree; refcount counts its live containers */
+struct qjson_block {
+    uint32_t refcount;
+    size_t size;
+    char data[] __attribute__((aligned(16)));
+};
+
+struct qjson_node {
+    uint32_t refcount;
+    uint32_t flags;
+    struct qjson_node *parent;
+    struct qjson_fragment *cache;
+    struct qjson_block *block;      /* NULL unless the container lives in a compacted block */
+};
+
 struct qjson_object {
+    struct qjson_node node;
     struct qjson_pair head;
 };
 typedef struct qjson_object qjson_object_t;
@@ -61,18 +166,117 @@ struct qjson_array_item {
 };
 typedef struct qjson_array_item qjson_array_item_t;
 
+/*
+ * An array whose members are all QJSON_INT or all QJSON_FLOAT may be
+ * packed: the numbers sit in one column and head.next stays NULL. Arrays
+ * are item lists unless asked for, with QJSON_PARSE_PACK_ARRAYS or
+ * qjson_array_pack; appending a number of the column's type to a packed
+ * array keeps it packed, storing anything else unpacks it first.
+ */
 struct qjson_array {
+    struct qjson_node node;
     struct qjson_array_item head;
+    qjson_type_t packed;        /* QJSON_INT or QJSON_FLOAT; QJSON_INVALID for an item list */
+    size_t count;
+    size_t cap;
+    union {
+        int64_t *ints;
+        double *doubles;
+    } column;
 };
 typedef struct qjson_array qjson_array_t;
 
 
+/*
+ * Allocator for the memory a parser context owns, and only that: the
+ * scratch buffer and the container stack. Trees never come from it. A
+ * tree outlives its parser and is freed by qjson_value_unref, copied on
+ * write and compacted by code that does not know which parser built it,
+ * so all of a tree's memory comes from malloc.
+ */
+struct qjson_allocator {
+    void *(*realloc)(void *userdata, void *ptr, size_t size);
+    void (*free)(void *userdata, void *ptr);
+    void *userdata;
+};
+typedef struct qjson_allocator qjson_allocator_t;
+
+#define QJSON_DEFAULT_MAX_DEPTH 512
+
+/* keep every number as QJSON_NUMBER instead of converting it while parsing */
+#define QJSON_PARSE_LAZY_NUMBERS 0x1
+/*
+ * Pack arrays of only ints or only floats into columns, read with
+ * qjson_array_ints and qjson_array_doubles. A packed array has no items,
+ * so code walking head.next sees it as empty. No function refuses one:
+ * qjson_value_at_mut, and qjson_array_append or qjson_array_append_new
+ * given a value of another type, turn it back into an item list first,
+ * and every other function takes it as it is.
+ */
+#define QJSON_PARSE_PACK_ARRAYS  0x2
+/* the input outlives the tree: long number text points into it instead of being copied */
+#define QJSON_PARSE_BORROW_INPUT 0x4
+
+/*
+ * There is no engine option: this file has one parser, so there is
+ * nothing to choose between.
+ */
+struct qjson_parser_options {
+    uint32_t max_depth;                 /* 0 means QJSON_DEFAULT_MAX_DEPTH */
+    const qjson_allocator_t *allocator; /* NULL means malloc/realloc/free */
+    uint32_t flags;                     /* QJSON_PARSE_* */
+};
+typedef struct qjson_parser_options qjson_parser_options_t;
+
+/* one open array or object; tail is the node new members are linked after */
+struct qjson_parser_frame {
+    qjson_type_t json_type;
+    struct qjson_node *node;
+    qjson_array_t *array;
+    union {
+        qjson_array_item_t *item;
+        qjson_pair_t *pair;
+    } tail;
+};
+
+/*
+ * Reusable parse state. Scratch and stack grow on demand and are kept
+ * across qjson_parser_reset, so a long running loop stops allocating
+ * parser memory once it has seen its largest string and deepest document.
+ * A context must not be shared between threads; use one per thread.
+ */
+struct qjson_parser {
+    uint32_t max_depth;
+    uint32_t flags;
+    qjson_allocator_t allocator;
+
+    char *scratch;
+    uint32_t scratch_cap;
+
+    struct qjson_parser_frame *stack;
+    uint32_t stack_cap;
+    uint32_t depth;
+
+    qjson_value_t pending;      /* array member not yet known to fit the column */
+};
+typedef struct qjson_parser qjson_parser_t;
+
+
 qjson_array_t *qjson_create_array();
 qjson_array_t *qjson_array_append(qjson_array_t *arr, const qjson_value_t *e);
 qjson_object_t *qjson_create_object();
 qjson_object_t *qjson_object_append(qjson_object_t *obj, const char *key, const qjson_value_t *e);
+qjson_value_t *qjson_value_ref(const qjson_value_t *value);
+void qjson_value_unref(qjson_value_t *value);
+const char *qjson_value_number_text(const qjson_value_t *value, uint32_t *len);
 
 uint32_t qjson_load(const char *str, qjson_value_t **value, const char **parse_end);
+uint32_t qjson_dump_ex(const qjson_value_t *value, char *buf, uint32_t len, uint32_t flags);
+static const char *qjson_scan_number(const char *str, const char *end, bool *is_float);
+static bool qjson_array_packable(const qjson_array_t *arr, const qjson_value_t *e);
+static void qjson_array_column_push(qjson_array_t *arr, const qjson_value_t *e);
+static qjson_array_item_t *qjson_array_unpack(qjson_array_t *arr);
+static void qjson_value_clear(qjson_value_t *value);
 
 qjson_value_t *qjson_create_int(int64_t i) {
     qjson_value_t *self = malloc(sizeof(*self));
@@ -90,14 +294,51 @@ qjson_value_t *qjson_create_float(double f) {
     return self;
 }
 
-qjson_value_t *qjson_create_str(const char *str) {
+static inline const char *qjson_strbuf_get(const union qjson_strbuf *s, uint32_t len) {
+    return len < QJSON_SSO_SIZE? s->sso: s->heap;
+}
+
+static char *qjson_strbuf_set(union qjson_strbuf *s, const char *str, uint32_t len) {
+    char *to = s->sso;
+    if(len >= QJSON_SSO_SIZE) {
+        to = malloc(len + 1);
+        s->heap = to;
+    }
+    memcpy(to, str, len);
+    to[len] = '\0';
+    return to;
+}
+
+static inline void qjson_strbuf_free(union qjson_strbuf *s, uint32_t len) {
+    if(len >= QJSON_SSO_SIZE) {
+        free(s->heap);
+    }
+}
+
+const char *qjson_value_str(const qjson_value_t *value) {
+    if(value->json_type != QJSON_STRING) {
+        return NULL;
+    }
+    return qjson_strbuf_get(&value->v.str, value->len);
+}
+
+const char *qjson_pair_key(const qjson_pair_t *pair) {
+    return qjson_strbuf_get(&pair->key, pair->keylen);
+}
+
+qjson_value_t *qjson_create_strn(const char *str, uint32_t len) {
     qjson_value_t *self = malloc(sizeof(*self));
     memset(self, 0, sizeof(*self));
     self->json_type = QJSON_STRING;
-    self->v.str = strdup(str);
+    self->len = len;
+    qjson_strbuf_set(&self->v.str, str, len);
     return self;
 }
 
+qjson_value_t *qjson_create_str(const char *str) {
+    return qjson_create_strn(str, strlen(str));
+}
+
 qjson_value_t *qjson_create_bool(bool value) {
     qjson_value_t *self = malloc(sizeof(*self));
     memset(self, 0, sizeof(*self));
@@ -113,45 +354,151 @@ qjson_value_t *qjson_create_null() {
     return self;
 }
 
-uint32_t str_espace_len(const char *str) {
-    uint32_t len = 0;
-    for(const char *end = str; *end != '\0'; end++){
-        switch(*end) {
-        case '\"':
-        case '\\':
-        case '\b':
-        case '\f':
-        case '\n':
-        case '\r':
-        case '\t':
-            len += 2;
-            break;
-        default:
-            len++;
-        };
+#define QJSON_DUMP_ASCII    0x1     /* escape everything above 0x7F as \uXXXX */
+
+/* escape for each byte: 0 copies it, 'u' writes \u00XX, anything else \<c> */
+static const char qjson_escape_table[256] = {
+    [0x00 ... 0x1F] = 'u',
+    ['\b'] = 'b',
+    ['\f'] = 'f',
+    ['\n'] = 'n',
+    ['\r'] = 'r',
+    ['\t'] = 't',
+    ['\"'] = '\"',
+    ['\\'] = '\\',
+};
+
+static const char qjson_hexdigits[] = "0123456789abcdef";
+
+/* value of a hex digit, -1 for anything else */
+static const int8_t qjson_hexval[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/* the 4 hex digits at hex, or -1; stops at the first non-digit so it never reads past a NUL */
+static inline int32_t qjson_hex4(const char *hex) {
+    int32_t cp = 0;
+    for(int i = 0; i < 4; i++) {
+        int8_t d = qjson_hexval[(unsigned char)hex[i]];
+        if(d < 0) {
+            return -1;
+        }
+        cp = (cp << 4) | d;
     }
-    return len;
+    return cp;
 }
 
-int32_t qjson_strlen(const char *str) {
-    const char *end = str;
-    if(*end == '\"'){
-        end++;
-    }else{
-        return -1;
+static inline uint32_t qjson_utf8_encode(uint32_t cp, char *to) {
+    if(cp < 0x80) {
+        to[0] = cp;
+        return 1;
+    } else if(cp < 0x800) {
+        to[0] = 0xC0 | (cp >> 6);
+        to[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if(cp < 0x10000) {
+        to[0] = 0xE0 | (cp >> 12);
+        to[1] = 0x80 | ((cp >> 6) & 0x3F);
+        to[2] = 0x80 | (cp & 0x3F);
+        return 3;
     }
+    to[0] = 0xF0 | (cp >> 18);
+    to[1] = 0x80 | ((cp >> 12) & 0x3F);
+    to[2] = 0x80 | ((cp >> 6) & 0x3F);
+    to[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
 
-    while(*end != '\0' && *end != '\"') {
-        if(*end == '\\') {
-            end++;
+/*
+ * Decode the UTF-8 sequence starting with a byte >= 0x80. Returns its
+ * length, or 0 if it is not well formed (overlong, surrogate, too large
+ * or cut short by len).
+ */
+static inline uint32_t qjson_utf8_decode(const unsigned char *s, size_t len, uint32_t *cp) {
+    uint32_t n;
+    unsigned char c = s[0];
+    if(c >= 0xC2 && c <= 0xDF) {
+        n = 1;
+        *cp = c & 0x1F;
+    } else if(c >= 0xE0 && c <= 0xEF) {
+        n = 2;
+        *cp = c & 0x0F;
+    } else if(c >= 0xF0 && c <= 0xF4) {
+        n = 3;
+        *cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if(len <= n) {
+        return 0;
+    }
+    for(uint32_t k = 1; k <= n; k++) {
+        if((s[k] & 0xC0) != 0x80) {
+            return 0;
         }
-        end++;
+        *cp = (*cp << 6) | (s[k] & 0x3F);
+    }
+    if(n == 2 && (*cp < 0x800 || (*cp >= 0xD800 && *cp <= 0xDFFF))) {
+        return 0;
+    }
+    if(n == 3 && (*cp < 0x10000 || *cp > 0x10FFFF)) {
+        return 0;
     }
+    return n + 1;
+}
 
-    return end - str;
+static inline void qjson_escape_u(char *to, uint32_t cp) {
+    to[0] = '\\';
+    to[1] = 'u';
+    to[2] = qjson_hexdigits[(cp >> 12) & 0xF];
+    to[3] = qjson_hexdigits[(cp >> 8) & 0xF];
+    to[4] = qjson_hexdigits[(cp >> 4) & 0xF];
+    to[5] = qjson_hexdigits[cp & 0xF];
 }
 
-uint32_t str_escape(const char *from, char *to, uint32_t len) {
+/* length of the plain run at from: bytes that need no escaping under flags */
+static inline uint32_t qjson_escape_run(const char *from, uint32_t from_len, uint32_t flags) {
+    uint32_t pos = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    while(pos + 16 <= from_len) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(from + pos));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, quote), _mm_cmpeq_epi8(in, backslash)),
+                                       _mm_cmpeq_epi8(_mm_max_epu8(in, control), control));
+        int mask = _mm_movemask_epi8(special);
+        if(flags & QJSON_DUMP_ASCII) {
+            mask |= _mm_movemask_epi8(in);      /* high bit set: not ASCII */
+        }
+        if(mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    while(pos < from_len) {
+        unsigned char c = from[pos];
+        if(qjson_escape_table[c] != 0 || (c >= 0x80 && (flags & QJSON_DUMP_ASCII))) {
+            break;
+        }
+        pos++;
+    }
+    return pos;
+}
+
+/*
+ * Escape from_len bytes of from into to, which holds len bytes including
+ * the terminator. Control characters without a short escape become
+ * \u00XX; with QJSON_DUMP_ASCII everything above 0x7F becomes \uXXXX (a
+ * surrogate pair above the BMP, � for bytes that are not UTF-8).
+ * Output stops before an escape that does not fit.
+ */
+uint32_t str_escapen(const char *from, uint32_t from_len, char *to, uint32_t len, uint32_t flags) {
     uint32_t from_pos = 0;
     uint32_t to_pos = 0;
     uint32_t last = len-1;
@@ -160,47 +507,120 @@ uint32_t str_escape(const char *from, char *to, uint32_t len) {
         return 0;
     }
 
-    while(from[from_pos] != '\0' && to_pos < last) {
-        switch(from[from_pos]) {
-        case '\"':
-            to[to_pos++] = '\\';
-            to[to_pos++] = '\"';
-            break;
-        case '\\':
-            to[to_pos++] = '\\';
-            to[to_pos++] = '\\';
-            break;
-        case '\b':
-            to[to_pos++] = '\\';
-            to[to_pos++] = 'b';
-            break;
-        case '\f':
-            to[to_pos++] = '\\';
-            to[to_pos++] = 'f';
-            break;
-        case '\n':
-            to[to_pos++] = '\\';
-            to[to_pos++] = 'n';
-            break;
-        case '\r':
-            to[to_pos++] = '\\';
-            to[to_pos++] = 'r';
+    while(from_pos < from_len && to_pos < last) {
+        uint32_t run = qjson_escape_run(from + from_pos, from_len - from_pos, flags);
+        run = MIN(run, last - to_pos);
+        memcpy(to + to_pos, from + from_pos, run);
+        from_pos += run;
+        to_pos += run;
+        if(from_pos == from_len || to_pos == last) {
             break;
-        case '\t':
+        }
+
+        unsigned char c = from[from_pos];
+        char e = qjson_escape_table[c];
+        if(c >= 0x80) {
+            uint32_t cp;
+            uint32_t n = qjson_utf8_decode((const unsigned char *)from + from_pos, from_len - from_pos, &cp);
+            if(n == 0) {
+                cp = 0xFFFD;
+                n = 1;
+            }
+            uint32_t need = cp >= 0x10000? 12: 6;
+            if(to_pos + need > last) {
+                break;
+            }
+            if(cp >= 0x10000) {
+                cp -= 0x10000;
+                qjson_escape_u(to + to_pos, 0xD800 | (cp >> 10));
+                qjson_escape_u(to + to_pos + 6, 0xDC00 | (cp & 0x3FF));
+            } else {
+                qjson_escape_u(to + to_pos, cp);
+            }
+            to_pos += need;
+            from_pos += n;
+            continue;
+        } else if(e == 'u') {
+            if(to_pos + 6 > last) {
+                break;
+            }
+            qjson_escape_u(to + to_pos, c);
+            to_pos += 6;
+        } else {
+            if(to_pos + 2 > last) {
+                break;
+            }
             to[to_pos++] = '\\';
-            to[to_pos++] = 't';
-            break;
-        default:
-            to[to_pos++] = from[from_pos];
-            break;
+            to[to_pos++] = e;
         }
         from_pos++;
     }
-    to_pos = to_pos < last? to_pos: last;
     to[to_pos] = '\0';
     return to_pos;
 }
 
+uint32_t str_escape(const char *from, char *to, uint32_t len) {
+    if(from == NULL) {
+        return 0;
+    }
+    return str_escapen(from, strlen(from), to, len, 0);
+}
+
+/* bytes str_escapen writes for from, without the terminator */
+size_t str_escape_lenn(const char *from, uint32_t from_len, uint32_t flags) {
+    size_t len = 0;
+    uint32_t pos = 0;
+    while(pos < from_len) {
+        uint32_t run = qjson_escape_run(from + pos, from_len - pos, flags);
+        len += run;
+        pos += run;
+        if(pos == from_len) {
+            break;
+        }
+
+        unsigned char c = from[pos];
+        if(c >= 0x80) {
+            uint32_t cp;
+            uint32_t n = qjson_utf8_decode((const unsigned char *)from + pos, from_len - pos, &cp);
+            len += n != 0 && cp >= 0x10000? 12: 6;
+            pos += MAX(n, 1);
+        } else {
+            len += qjson_escape_table[c] == 'u'? 6: 2;
+            pos++;
+        }
+    }
+    return len;
+}
+
+uint32_t str_espace_len(const char *str) {
+    return str_escape_lenn(str, strlen(str), 0);
+}
+
+int32_t qjson_strlen(const char *str) {
+    const char *end = str;
+    if(*end == '\"'){
+        end++;
+    }else{
+        return -1;
+    }
+
+    while(*end != '\0' && *end != '\"') {
+        if(*end == '\\' && end[1] != '\0') {
+            end++;
+        }
+        end++;
+    }
+
+    return end - str;
+}
+
+/*
+ * Unescape the quoted string at from into to (len bytes including the
+ * terminator) and return its length. \uXXXX escapes are decoded to UTF-8,
+ * joining surrogate pairs; a lone surrogate becomes U+FFFD. *parse_end is
+ * set past the closing quote, or to the offending backslash when an
+ * escape is invalid.
+ */
 uint32_t str_unescape(const char *from, char *to, uint32_t len, const char **parse_end) {
     uint32_t from_pos = 0;
     uint32_t to_pos = 0;
@@ -226,6 +646,9 @@ uint32_t str_unescape(const char *from, char *to, uint32_t len, const char **par
             case '\\':
                 to[to_pos++] = '\\';
                 break;
+            case '/':
+                to[to_pos++] = '/';
+                break;
             case 'b':
                 to[to_pos++] = '\b';
                 break;
@@ -241,8 +664,34 @@ uint32_t str_unescape(const char *from, char *to, uint32_t len, const char **par
             case 't':
                 to[to_pos++] = '\t';
                 break;
+            case 'u': {
+                int32_t cp = qjson_hex4(&from[from_pos + 1]);
+                if(cp < 0) {
+                    goto invalid;
+                }
+                from_pos += 4;
+                if(cp >= 0xD800 && cp <= 0xDBFF && from[from_pos + 1] == '\\' && from[from_pos + 2] == 'u') {
+                    int32_t low = qjson_hex4(&from[from_pos + 3]);
+                    if(low >= 0xDC00 && low <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        from_pos += 6;
+                    }
+                }
+                if(cp >= 0xD800 && cp <= 0xDFFF) {
+                    cp = 0xFFFD;
+                }
+                char utf8[4];
+                uint32_t n = qjson_utf8_encode(cp, utf8);
+                if(n > last - to_pos) {
+                    last = to_pos;      /* does not fit: stop before it */
+                    break;
+                }
+                memcpy(&to[to_pos], utf8, n);
+                to_pos += n;
+                break;
+            }
             default:
-                to[to_pos++] = from[from_pos];
+                goto invalid;
             }
         } else {
             to[to_pos++] = from[from_pos];
@@ -258,495 +707,3911 @@ uint32_t str_unescape(const char *from, char *to, uint32_t len, const char **par
     to_pos = to_pos < last? to_pos: last;
     to[to_pos] = '\0';
     return to_pos;
-}
 
-
-uint32_t qjson_dump_string(char *str, char *buf, int len) {
-    if(str == NULL || len < 3){
-        return 0;
+invalid:
+    if(parse_end != NULL) {
+        *parse_end = &from[from_pos - 1];
     }
-    int i = 0;
-    buf[i++] = '\"';
-    i += str_escape(str, &buf[i], len-3);
-    buf[i++] = '\"';
-    buf[i] = '\0';
-    return i;
+    to[MIN(to_pos, last)] = '\0';
+    return MIN(to_pos, last);
 }
 
-uint32_t qjson_dump_bool(qjson_value_t *value, char *buf, int len) {
-    if(value == NULL || len < sizeof("false")){
-        return 0;
-    }
 
-    char *result = value->v.boolean?"true": "false";
-    strncpy(buf, result, len);
-    return strlen(result);
+static inline void qjson_node_init(struct qjson_node *node) {
+    node->refcount = 1;
 }
 
-uint32_t qjson_dump_null(qjson_value_t *value, char *buf, int len) {
-    if(value == NULL || len < sizeof("null")){
-        return 0;
-    }
+static inline void qjson_node_ref(struct qjson_node *node) {
+    __atomic_fetch_add(&node->refcount, 1, __ATOMIC_RELAXED);
+}
 
-    strncpy(buf, "null", len);
-    return strlen("null");
+/* returns true when the last reference was dropped */
+static inline bool qjson_node_unref(struct qjson_node *node) {
+    return __atomic_sub_fetch(&node->refcount, 1, __ATOMIC_ACQ_REL) == 0;
 }
 
+static inline bool qjson_node_shared(const struct qjson_node *node) {
+    return __atomic_load_n(&node->refcount, __ATOMIC_ACQUIRE) > 1;
+}
 
-uint32_t qjson_dump_array(const qjson_array_t *arr, char *buf, uint32_t len);
-uint32_t qjson_dump_object(const qjson_object_t *obj, char *buf, uint32_t len);
+/* only a private container may be modified in place */
+static inline bool qjson_node_private(const struct qjson_node *node) {
+    return !qjson_node_shared(node) && !(__atomic_load_n(&node->flags, __ATOMIC_RELAXED) & QJSON_NODE_FROZEN);
+}
 
-uint32_t qjson_dump(qjson_value_t *value, char *buf, uint32_t len) {
-    qjson_type_t json_type = value->json_type;
-    switch (json_type) {
-    case QJSON_INT:
-        return snprintf(buf, len, "%lld", value->v.integer);
-    case QJSON_FLOAT:
-        return snprintf(buf, len, "%lf", value->v.fraction);
-    case QJSON_STRING:
-        return qjson_dump_string(value->v.str, buf, len);
-    case QJSON_ARRAY:
-        return qjson_dump_array(value->v.array, buf, len);
-    case QJSON_OBJECT:
-        return qjson_dump_object(value->v.object, buf, len);
-    case QJSON_NULL:
-        return qjson_dump_null(value, buf, len);
-    case QJSON_BOOL:
-        return qjson_dump_bool(value, buf, len);
-    default:
-        return 0;
+static inline struct qjson_node *qjson_value_node(const qjson_value_t *value) {
+    if(value->json_type == QJSON_ARRAY) {
+        return &value->v.array->node;
+    } else if(value->json_type == QJSON_OBJECT) {
+        return &value->v.object->node;
     }
+    return NULL;
 }
 
+static void qjson_fragment_free(struct qjson_fragment *frag) {
+    while(frag != NULL) {
+        struct qjson_fragment *next = frag->next;
+        free(frag);
+        frag = next;
+    }
+}
 
-uint32_t qjson_dump_array(const qjson_array_t *arr, char *buf, uint32_t len) {
-    if(arr == NULL || len < 2){
-        return 0;
+/* node is about to change: it and every container above it become dirty */
+static void qjson_node_invalidate(struct qjson_node *node) {
+    while(node != NULL) {
+        qjson_fragment_free(__atomic_exchange_n(&node->cache, NULL, __ATOMIC_ACQ_REL));
+        node = __atomic_load_n(&node->parent, __ATOMIC_RELAXED);
     }
+}
 
-    int i = 0;
-    buf[i++] = '[';
-    qjson_array_item_t *item = arr->head.next;
-    while(item != NULL) {
-        i += qjson_dump(&item->value, buf+i, len-i);
-        if(item->next != NULL) {
-            buf[i++] = ',';
-            buf[i++] = ' ';
-        }
-        item = item->next;
+/*
+ * Output buffer shared by all serializers. A fixed buffer wraps caller
+ * memory and truncates, a growable one reallocs; both stay NUL terminated.
+ */
+struct qjson_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    uint32_t flags;     /* QJSON_DUMP_* */
+    bool growable;
+    bool truncated;
+};
+typedef struct qjson_buf qjson_buf_t;
+
+void qjson_buf_init(qjson_buf_t *b) {
+    memset(b, 0, sizeof(*b));
+    b->growable = true;
+}
+
+static void qjson_buf_init_fixed(qjson_buf_t *b, char *buf, size_t len) {
+    memset(b, 0, sizeof(*b));
+    b->data = buf;
+    b->cap = len;
+    if(len > 0) {
+        buf[0] = '\0';
     }
-    buf[i++] = ']';
-    buf[i] = '\0';
-    return i;
 }
 
-uint32_t qjson_dump_object(const qjson_object_t *obj, char *buf, uint32_t len) {
-    if(obj == NULL || len < 2){
-        return 0;
+void qjson_buf_release(qjson_buf_t *b) {
+    if(b->growable) {
+        free(b->data);
     }
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
 
-    int i = 0;
-    buf[i++] = '{';
-    qjson_pair_t *pair = obj->head.next;
-    while(pair != NULL) {
-        i += qjson_dump_string(pair->key, buf+i, len-i);
-        if(i + 2 < len) {
-            buf[i++] = ':';
-            buf[i++] = ' ';
-        } else {
-            return 0;
-        }
+/* room for n more bytes plus the terminator, NULL if a fixed buffer is full */
+static char *qjson_buf_reserve(qjson_buf_t *b, size_t n) {
+    if(b->len + n < b->cap) {
+        return b->data + b->len;
+    }
+    if(!b->growable) {
+        return NULL;
+    }
 
-        i += qjson_dump(&pair->value, buf+i, len-i);
+    size_t cap = MAX(b->cap * 2, 256);
+    while(cap <= b->len + n) {
+        cap *= 2;
+    }
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+    return b->data + b->len;
+}
 
-        if(pair->next != NULL && i + 2 < len) {
-            buf[i++] = ',';
-            buf[i++] = ' ';
+static void qjson_buf_put(qjson_buf_t *b, const char *data, size_t n) {
+    char *to = qjson_buf_reserve(b, n);
+    if(to == NULL) {
+        if(b->cap == 0) {
+            return;
         }
-        pair = pair->next;
+        n = b->cap - 1 - b->len;
+        to = b->data + b->len;
+        b->truncated = true;
     }
+    memcpy(to, data, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
 
-    if(i + 2 < len) {
-        buf[i++] = '}';
-        buf[i] = '\0';
-        return i;
-    } else {
-        return 0;
-    }
+static inline void qjson_buf_putc(qjson_buf_t *b, char c) {
+    qjson_buf_put(b, &c, 1);
 }
 
+/* strings longer than this are measured before reserving instead of assuming the worst case */
+#define QJSON_ESCAPE_MEASURE (64 * 1024)
 
-uint32_t qjson_load_string(const char *str, qjson_value_t **value, const char **parse_end) {
-    const char *pos = str;
-    while(isspace(*pos)) {
-        pos++;
+static void qjson_buf_dump_string(qjson_buf_t *b, const char *str, uint32_t len) {
+    /* every byte escapes to at most six (\u00XX, or \ufffd for a stray byte) */
+    size_t need = 6 * (size_t)len + 2;
+    char *to = NULL;
+    if(len < QJSON_ESCAPE_MEASURE) {
+        to = qjson_buf_reserve(b, need);
     }
-
-    if(*pos != '\"') {
-        *parse_end = pos;
-        return FAILURE;
+    if(to == NULL) {
+        need = str_escape_lenn(str, len, b->flags) + 2;
+        to = qjson_buf_reserve(b, need);
     }
 
-    int32_t len = strlen(pos); //TODO
-    char *buf = malloc(len);
-    str_unescape(pos, buf, len, parse_end);
-    pos = *parse_end;
-
-    if(pos[-1] == '\"') {
-        *value = qjson_create_str(buf);
-        free(buf);
-        return SUCCESS;
+    if(to == NULL) {
+        /* does not fit: keep what a truncating escape produces */
+        char *tmp = malloc(need + 1);
+        tmp[0] = '\"';
+        uint32_t n = str_escapen(str, len, tmp + 1, need - 1, b->flags);
+        tmp[n + 1] = '\"';
+        qjson_buf_put(b, tmp, n + 2);
+        free(tmp);
+        return;
     }
 
-    return FAILURE;
+    to[0] = '\"';
+    uint32_t n = str_escapen(str, len, to + 1, need, b->flags);
+    to[n + 1] = '\"';
+    b->len += n + 2;
+    b->data[b->len] = '\0';
 }
 
-uint32_t qjson_load_bool(const char *str, qjson_value_t **value, const char **parse_end) {
-    bool result = false;
-    int parse_len = 0;
-    int false_len = strlen("false");
-    int true_len = strlen("true");
+static void qjson_buf_dump_value(qjson_buf_t *b, const qjson_value_t *value);
 
-    if(strncmp(str, "false", false_len)  == 0){
-        result = false;
-        parse_len = false_len;
-    } else if (strncmp(str, "true", true_len) ==0 ) {
-        result = true;
-        parse_len = true_len;
-    } else {
-        *parse_end = str;
-        *value = NULL;
-        return FAILURE;
+/* count items starting at item, ", " separated; first means no leading separator */
+static void qjson_buf_dump_items(qjson_buf_t *b, const qjson_array_item_t *item, size_t count, bool first) {
+    for(; item != NULL && count > 0; item = item->next, count--) {
+        if(!first) {
+            qjson_buf_put(b, ", ", 2);
+        }
+        first = false;
+        qjson_buf_dump_value(b, &item->value);
     }
-
-    qjson_value_t *boolean = malloc(sizeof(qjson_value_t));
-    memset(boolean, 0, sizeof(qjson_value_t));
-    boolean->json_type = QJSON_BOOL;
-    boolean->v.boolean = result;
-    *value = boolean;
-    *parse_end = str + parse_len;
-    return SUCCESS;
 }
 
-uint32_t qjson_load_null(const char *str, qjson_value_t **value, const char **parse_end) {
-    int null_len = strlen("null");
-    if(strncmp(str, "null", null_len) == 0){
-
-        qjson_value_t *null = malloc(sizeof(qjson_value_t));
-        memset(null, 0, sizeof(qjson_value_t));
-        null->json_type = QJSON_NULL;
-        *value = null;
-        *parse_end = str + null_len;
-        return SUCCESS;
-    } else {
-        printf("nullstr:%s\n", str);
+static void qjson_buf_dump_pairs(qjson_buf_t *b, const qjson_pair_t *pair, size_t count, bool first) {
+    for(; pair != NULL && count > 0; pair = pair->next, count--) {
+        if(!first) {
+            qjson_buf_put(b, ", ", 2);
+        }
+        first = false;
+        qjson_buf_dump_string(b, qjson_pair_key(pair), pair->keylen);
+        qjson_buf_put(b, ": ", 2);
+        qjson_buf_dump_value(b, &pair->value);
     }
-    *value = NULL;
-    *parse_end = str;
-    return FAILURE;
 }
 
+/* node's cached bytes if they were written with flags */
+static inline struct qjson_fragment *qjson_node_cached(struct qjson_node *node, uint32_t flags) {
+    struct qjson_fragment *frag = __atomic_load_n(&node->cache, __ATOMIC_ACQUIRE);
+    while(frag != NULL && frag->flags != flags) {
+        frag = frag->next;
+    }
+    return frag;
+}
 
-uint32_t qjson_load_integer(const char *str, int64_t *integer, const char **parse_end) {
-#define INTEGER_STR_MAX_LEN 20
-    int rpos = 0;
-    int wpos = 0;
-    char integer_str[INTEGER_STR_MAX_LEN + 1];
+/* copy node's cached bytes, if it has any */
+static bool qjson_buf_dump_cached(qjson_buf_t *b, struct qjson_node *node) {
+    struct qjson_fragment *frag = qjson_node_cached(node, b->flags);
+    if(frag == NULL) {
+        return false;
+    }
+    qjson_buf_put(b, frag->data, frag->len);
+    return true;
+}
 
-    while((isdigit(str[rpos]) || str[rpos] == '-' ) && wpos < INTEGER_STR_MAX_LEN) {
-        integer_str[wpos++] = str[rpos++];
+/*
+ * Keep the bytes node serialized to, from start to the end of b, next to
+ * any kept for other flags. Concurrent dumps of a shared container with
+ * the same flags may race here; the first one wins.
+ */
+static void qjson_buf_cache_fill(qjson_buf_t *b, struct qjson_node *node, size_t start) {
+    size_t len = b->len - start;
+    if(!(__atomic_load_n(&node->flags, __ATOMIC_RELAXED) & QJSON_NODE_CACHE) || b->truncated || len < QJSON_CACHE_MIN) {
+        return;
     }
-    integer_str[wpos] = '\0';
-    *integer = strtoll(integer_str, NULL, 10);
-    //sscanf(integer_str, "%lld", integer);
-    *parse_end = str+wpos;
 
-    if(wpos != 0) {
-        return SUCCESS;
+    struct qjson_fragment *frag = malloc(sizeof(*frag) + len);
+    frag->len = len;
+    frag->flags = b->flags;
+    memcpy(frag->data, b->data + start, len);
+
+    frag->next = __atomic_load_n(&node->cache, __ATOMIC_ACQUIRE);
+    do {
+        if(qjson_node_cached(node, b->flags) != NULL) {
+            free(frag);
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&node->cache, &frag->next, frag, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static void qjson_buf_dump_int(qjson_buf_t *b, int64_t integer) {
+    char num[24];
+    char *end = num + sizeof(num);
+    char *pos = end;
+    uint64_t u = integer < 0? 0 - (uint64_t)integer: (uint64_t)integer;
+    do {
+        *--pos = '0' + u % 10;
+        u /= 10;
+    } while(u != 0);
+    if(integer < 0) {
+        *--pos = '-';
+    }
+    qjson_buf_put(b, pos, end - pos);
+}
+
+static void qjson_buf_dump_double(qjson_buf_t *b, double fraction) {
+    char num[512];
+    int n = snprintf(num, sizeof(num), "%lf", fraction);
+    qjson_buf_put(b, num, MIN(n, (int)sizeof(num) - 1));
+}
+
+/* count numbers of a packed array from index start */
+static void qjson_buf_dump_column(qjson_buf_t *b, const qjson_array_t *arr, size_t start, size_t count, bool first) {
+    size_t end = start + MIN(count, arr->count - start);
+    if(arr->packed == QJSON_INT) {
+        for(size_t i = start; i < end; i++) {
+            if(!first) {
+                qjson_buf_put(b, ", ", 2);
+            }
+            first = false;
+            qjson_buf_dump_int(b, arr->column.ints[i]);
+        }
     } else {
-        return FAILURE;
+        for(size_t i = start; i < end; i++) {
+            if(!first) {
+                qjson_buf_put(b, ", ", 2);
+            }
+            first = false;
+            qjson_buf_dump_double(b, arr->column.doubles[i]);
+        }
     }
 }
 
-uint32_t qjson_load_fraction(const char *str, uint64_t *fraction, const char **parse_end) {
-    if(*str != '.') {
-        *fraction = 0;
-        *parse_end = str;
-        return FAILURE;
+static void qjson_buf_dump_array(qjson_buf_t *b, const qjson_array_t *arr) {
+    qjson_buf_putc(b, '[');
+    if(arr->packed != QJSON_INVALID) {
+        qjson_buf_dump_column(b, arr, 0, arr->count, true);
+    } else {
+        qjson_buf_dump_items(b, arr->head.next, SIZE_MAX, true);
     }
+    qjson_buf_putc(b, ']');
+}
 
-    uint32_t rpos = 1;
-    uint32_t wpos = 0;
-    char buf[INTEGER_STR_MAX_LEN+1];
-    while(isdigit(str[rpos]) && wpos < INTEGER_STR_MAX_LEN) {
-        buf[wpos++] = str[rpos++];
+static void qjson_buf_dump_value(qjson_buf_t *b, const qjson_value_t *value) {
+    size_t start = b->len;
+
+    switch (value->json_type) {
+    case QJSON_INT:
+        qjson_buf_dump_int(b, value->v.integer);
+        break;
+    case QJSON_FLOAT:
+        qjson_buf_dump_double(b, value->v.fraction);
+        break;
+    case QJSON_STRING:
+        qjson_buf_dump_string(b, qjson_value_str(value), value->len);
+        break;
+    case QJSON_NUMBER: {
+        uint32_t len;
+        const char *text = qjson_value_number_text(value, &len);
+        qjson_buf_put(b, text, len);
+        break;
+    }
+    case QJSON_ARRAY:
+        if(qjson_buf_dump_cached(b, &value->v.array->node)) {
+            break;
+        }
+        qjson_buf_dump_array(b, value->v.array);
+        qjson_buf_cache_fill(b, &value->v.array->node, start);
+        break;
+    case QJSON_OBJECT:
+        if(qjson_buf_dump_cached(b, &value->v.object->node)) {
+            break;
+        }
+        qjson_buf_putc(b, '{');
+        qjson_buf_dump_pairs(b, value->v.object->head.next, SIZE_MAX, true);
+        qjson_buf_putc(b, '}');
+        qjson_buf_cache_fill(b, &value->v.object->node, start);
+        break;
+    case QJSON_NULL:
+        qjson_buf_put(b, "null", 4);
+        break;
+    case QJSON_BOOL:
+        if(value->v.boolean) {
+            qjson_buf_put(b, "true", 4);
+        } else {
+            qjson_buf_put(b, "false", 5);
+        }
+        break;
+    default:
+        break;
     }
-    buf[wpos] = '\0';
-    *fraction = strtoull(buf, NULL, 10);
-    return SUCCESS;
 }
 
-uint32_t qjson_load_exponent(const char *str, int32_t *exponent, const char **parse_end) {
-    if(*str != 'e' && *str != 'E') {
-        *exponent = 0;
-        *parse_end = str;
-        return FAILURE;
+uint32_t qjson_dump_string(const char *str, char *buf, int len) {
+    if(str == NULL || len < 3){
+        return 0;
     }
+    qjson_buf_t b;
+    qjson_buf_init_fixed(&b, buf, len);
+    qjson_buf_dump_string(&b, str, strlen(str));
+    return b.len;
+}
 
-    uint32_t rpos = 1;
-    uint32_t wpos = 0;
-    char buf[INTEGER_STR_MAX_LEN+1];
+uint32_t qjson_dump_bool(qjson_value_t *value, char *buf, int len) {
+    if(value == NULL || len < sizeof("false")){
+        return 0;
+    }
+    qjson_buf_t b;
+    qjson_buf_init_fixed(&b, buf, len);
+    qjson_buf_dump_value(&b, value);
+    return b.len;
+}
 
-    if(str[rpos] == '-') {
-		buf[wpos++] = str[rpos++];
-	} else if (str[rpos] == '+') {
-		rpos++;
-	} else {
-	}
+uint32_t qjson_dump_null(qjson_value_t *value, char *buf, int len) {
+    if(value == NULL || len < sizeof("null")){
+        return 0;
+    }
+    qjson_buf_t b;
+    qjson_buf_init_fixed(&b, buf, len);
+    qjson_buf_dump_value(&b, value);
+    return b.len;
+}
 
-    while(isdigit(str[rpos]) && wpos < INTEGER_STR_MAX_LEN) {
-        buf[wpos++] = str[rpos++];
+/*
+ * Serialize into buf, truncating at len - 1 bytes. The result is always
+ * NUL terminated and the number of bytes written is returned.
+ */
+uint32_t qjson_dump(qjson_value_t *value, char *buf, uint32_t len) {
+    return qjson_dump_ex(value, buf, len, 0);
+}
+
+/* qjson_dump with QJSON_DUMP_* flags */
+uint32_t qjson_dump_ex(const qjson_value_t *value, char *buf, uint32_t len, uint32_t flags) {
+    qjson_buf_t b;
+    qjson_buf_init_fixed(&b, buf, len);
+    b.flags = flags;
+    qjson_buf_dump_value(&b, value);
+    return b.len;
+}
+
+/* serialize into a malloc'd buffer; the caller frees it */
+char *qjson_dump_alloc(const qjson_value_t *value, uint32_t flags, size_t *len) {
+    qjson_buf_t b;
+    qjson_buf_init(&b);
+    b.flags = flags;
+    qjson_buf_reserve(&b, 0);
+    b.data[0] = '\0';
+    qjson_buf_dump_value(&b, value);
+    if(len != NULL) {
+        *len = b.len;
     }
-    buf[wpos] = '\0';
-    *exponent = atoi(buf);
-    return SUCCESS;
+    return b.data;
 }
 
-uint32_t qjson_load_number(const char *str, qjson_value_t **value, const char **parse_end) {
-	const char *pos = str;
-	if(*pos == '-') {
-		pos++;
-	}
-	if(! isdigit(*pos)) {
-		*value = NULL;
-		*parse_end = str;
-		return FAILURE;
-	}
+uint32_t qjson_dump_array(const qjson_array_t *arr, char *buf, uint32_t len) {
+    if(arr == NULL || len < 2){
+        return 0;
+    }
+    qjson_buf_t b;
+    qjson_buf_init_fixed(&b, buf, len);
+    qjson_buf_dump_array(&b, arr);
+    return b.len;
+}
 
-	qjson_value_t *number = malloc(sizeof(*number));
-    memset(number, 0, sizeof(*number));
-    *value = number;
+uint32_t qjson_dump_object(const qjson_object_t *obj, char *buf, uint32_t len) {
+    if(obj == NULL || len < 2){
+        return 0;
+    }
+    qjson_buf_t b;
+    qjson_buf_init_fixed(&b, buf, len);
+    qjson_buf_putc(&b, '{');
+    qjson_buf_dump_pairs(&b, obj->head.next, SIZE_MAX, true);
+    qjson_buf_putc(&b, '}');
+    return b.len;
+}
 
-	while(isdigit(*pos)) {
-		pos++;
-	}
-    if(*pos == '.' || *pos == 'e' || *pos == 'E') {
-        number->json_type = QJSON_FLOAT;
-        number->v.fraction = strtod(str, (char**)parse_end);
-
-	}else{
-        number->json_type = QJSON_INT;
-		int64_t integer;
-		qjson_load_integer(str, &integer, parse_end);
-        number->v.integer = integer;
-	}
-	return SUCCESS;
+
+/*
+ * Parallel serialization. The tree is cut into an ordered list of jobs:
+ * runs of array items or object pairs, whole values, and the short text
+ * between them (brackets, keys), which is written while planning. Workers
+ * serialize jobs into their own buffers with the same code qjson_dump
+ * uses, and the caller's thread hands finished buffers to the sink in
+ * order, so the output is byte for byte the sequential one.
+ */
+#define QJSON_DUMP_CHUNK_SIZE 4096
+#define QJSON_DUMP_MAX_DEPTH 64
+#define QJSON_DUMP_MIN_JOB 256     /* smaller jobs cost more to hand out than to run */
+
+typedef int (*qjson_sink_t)(void *userdata, const char *data, size_t len);
+
+struct qjson_dump_options {
+    uint32_t threads;       /* 0: one per online CPU */
+    uint32_t chunk_size;    /* most members per job, 0: QJSON_DUMP_CHUNK_SIZE */
+    uint32_t flags;         /* QJSON_DUMP_* */
+};
+typedef struct qjson_dump_options qjson_dump_options_t;
+
+enum qjson_dump_job_kind {
+    QJSON_DUMP_TEXT,
+    QJSON_DUMP_VALUE,
+    QJSON_DUMP_ITEMS,
+    QJSON_DUMP_PAIRS,
+    QJSON_DUMP_COLUMN,
+};
+
+struct qjson_dump_job {
+    enum qjson_dump_job_kind kind;
+    bool first;
+    bool done;
+    size_t count;
+    size_t start;       /* first index of a column run */
+    union {
+        const qjson_value_t *value;
+        const qjson_array_item_t *item;
+        const qjson_pair_t *pair;
+        const qjson_array_t *array;
+    } from;
+    qjson_buf_t out;
+};
+
+struct qjson_dump_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    struct qjson_dump_job *jobs;
+    size_t njobs;
+    size_t cap;
+
+    size_t next;        /* next job a worker may take */
+    size_t emitted;     /* jobs already handed to the sink */
+    size_t window;      /* how far workers may run ahead of the sink */
+
+    uint32_t threads;
+    uint32_t chunk_size;
+    uint32_t flags;
+    size_t job_size;    /* weight a job aims for, see qjson_dump_weight */
+};
+
+static struct qjson_dump_job *qjson_dump_job_add(struct qjson_dump_pool *pool, enum qjson_dump_job_kind kind) {
+    if(pool->njobs == pool->cap) {
+        pool->cap = MAX(pool->cap * 2, 64);
+        pool->jobs = realloc(pool->jobs, pool->cap * sizeof(*pool->jobs));
+    }
+    struct qjson_dump_job *job = &pool->jobs[pool->njobs++];
+    memset(job, 0, sizeof(*job));
+    job->kind = kind;
+    qjson_buf_init(&job->out);
+    job->out.flags = pool->flags;
+    return job;
 }
 
+/* buffer for planner text, merged into the previous job when that is text too */
+static qjson_buf_t *qjson_dump_text(struct qjson_dump_pool *pool) {
+    struct qjson_dump_job *job = NULL;
+    if(pool->njobs > 0 && pool->jobs[pool->njobs - 1].kind == QJSON_DUMP_TEXT) {
+        job = &pool->jobs[pool->njobs - 1];
+    } else {
+        job = qjson_dump_job_add(pool, QJSON_DUMP_TEXT);
+        job->done = true;
+    }
+    return &job->out;
+}
 
-uint32_t qjson_load_object(const char *str, qjson_value_t **value, const char **parse_end) {
-    if(*str != '{') {
-        *value = NULL;
-        *parse_end = str;
-        return FAILURE;
+/*
+ * Rough size of value's output: one for every value in it, counting no
+ * further than limit. Clean cached containers count as one, since the
+ * planner copies them.
+ */
+static size_t qjson_dump_weight(const struct qjson_dump_pool *pool, const qjson_value_t *value, size_t limit) {
+    struct qjson_node *node = qjson_value_node(value);
+    if(node == NULL || qjson_node_cached(node, pool->flags) != NULL) {
+        return 1;
+    }
+    size_t weight = 1;
+    if(value->json_type == QJSON_ARRAY) {
+        if(value->v.array->packed != QJSON_INVALID) {
+            return weight + value->v.array->count;
+        }
+        for(const qjson_array_item_t *item = value->v.array->head.next; item != NULL && weight < limit; item = item->next) {
+            weight += qjson_dump_weight(pool, &item->value, limit - weight);
+        }
+    } else {
+        for(const qjson_pair_t *pair = value->v.object->head.next; pair != NULL && weight < limit; pair = pair->next) {
+            weight += qjson_dump_weight(pool, &pair->value, limit - weight);
+        }
     }
-    str++;
+    return weight;
+}
 
-    const char *pos = str;
-    qjson_object_t *obj = qjson_create_object();
-    while(*pos != '\0') {
+/*
+ * Members go out in runs of about job_size weight. A member at least that
+ * heavy is planned on its own one level down, so a large array under a
+ * small envelope is still shared out whatever the envelope's size.
+ */
+static void qjson_dump_plan(struct qjson_dump_pool *pool, const qjson_value_t *value, uint32_t depth) {
+    bool is_array = value->json_type == QJSON_ARRAY;
+    struct qjson_node *node = qjson_value_node(value);
+    if(node == NULL || qjson_node_cached(node, pool->flags) != NULL) {
+        /* scalars and clean cached containers are cheaper to copy here */
+        qjson_buf_dump_value(qjson_dump_text(pool), value);
+        return;
+    }
+    if(depth >= QJSON_DUMP_MAX_DEPTH) {
+        qjson_dump_job_add(pool, QJSON_DUMP_VALUE)->from.value = value;
+        return;
+    }
 
-        while(isspace(*pos)) {
-            pos++;
+    qjson_buf_putc(qjson_dump_text(pool), is_array? '[': '{');
+
+    if(is_array && value->v.array->packed != QJSON_INVALID) {
+        size_t n = value->v.array->count;
+        size_t run = MIN(pool->job_size, pool->chunk_size);
+        for(size_t i = 0; i < n; i += run) {
+            struct qjson_dump_job *job = qjson_dump_job_add(pool, QJSON_DUMP_COLUMN);
+            job->first = i == 0;
+            job->count = MIN(run, n - i);
+            job->from.array = value->v.array;
+            job->start = i;
         }
+    } else {
+        const qjson_array_item_t *item = is_array? value->v.array->head.next: NULL;
+        const qjson_pair_t *pair = is_array? NULL: value->v.object->head.next;
+        size_t run = SIZE_MAX;      /* index of the open run, jobs may move */
+        size_t run_weight = 0;
+        for(bool first = true; item != NULL || pair != NULL; first = false) {
+            const qjson_value_t *member = is_array? &item->value: &pair->value;
+            size_t weight = qjson_dump_weight(pool, member, pool->job_size);
+            if(weight >= pool->job_size) {
+                run = SIZE_MAX;
+                qjson_buf_t *text = qjson_dump_text(pool);
+                if(!first) {
+                    qjson_buf_put(text, ", ", 2);
+                }
+                if(!is_array) {
+                    qjson_buf_dump_string(text, qjson_pair_key(pair), pair->keylen);
+                    qjson_buf_put(text, ": ", 2);
+                }
+                qjson_dump_plan(pool, member, depth + 1);
+            } else {
+                if(run == SIZE_MAX || pool->jobs[run].count == pool->chunk_size || run_weight + weight > pool->job_size) {
+                    struct qjson_dump_job *job = qjson_dump_job_add(pool, is_array? QJSON_DUMP_ITEMS: QJSON_DUMP_PAIRS);
+                    job->first = first;
+                    if(is_array) {
+                        job->from.item = item;
+                    } else {
+                        job->from.pair = pair;
+                    }
+                    run = pool->njobs - 1;
+                    run_weight = 0;
+                }
+                pool->jobs[run].count++;
+                run_weight += weight;
+            }
+            if(is_array) {
+                item = item->next;
+            } else {
+                pair = pair->next;
+            }
+        }
+    }
 
-        if(*pos == '}'){
-            pos++;
+    qjson_buf_putc(qjson_dump_text(pool), is_array? ']': '}');
+}
+
+/* settle the pool's parameters and cut value into jobs */
+static void qjson_dump_pool_plan(struct qjson_dump_pool *pool, const qjson_value_t *value, const qjson_dump_options_t *options) {
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = options != NULL? options->threads: 0;
+    pool->chunk_size = options != NULL? options->chunk_size: 0;
+    pool->flags = options != NULL? options->flags: 0;
+    if(pool->threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool->threads = cpus > 0? cpus: 1;
+    }
+    if(pool->chunk_size == 0) {
+        pool->chunk_size = QJSON_DUMP_CHUNK_SIZE;
+    }
+    pool->window = pool->threads * 4;
+    pool->job_size = MAX(qjson_dump_weight(pool, value, SIZE_MAX) / (pool->threads * 4), QJSON_DUMP_MIN_JOB);
+    qjson_dump_plan(pool, value, 0);
+}
+
+static void qjson_dump_job_run(struct qjson_dump_job *job) {
+    switch(job->kind) {
+    case QJSON_DUMP_VALUE:
+        qjson_buf_dump_value(&job->out, job->from.value);
+        break;
+    case QJSON_DUMP_ITEMS:
+        qjson_buf_dump_items(&job->out, job->from.item, job->count, job->first);
+        break;
+    case QJSON_DUMP_PAIRS:
+        qjson_buf_dump_pairs(&job->out, job->from.pair, job->count, job->first);
+        break;
+    case QJSON_DUMP_COLUMN:
+        qjson_buf_dump_column(&job->out, job->from.array, job->start, job->count, job->first);
+        break;
+    default:
+        break;
+    }
+}
+
+static void *qjson_dump_worker(void *arg) {
+    struct qjson_dump_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->next < pool->njobs && pool->jobs[pool->next].done) {
+            pool->next++;
+        }
+        if(pool->next >= pool->njobs) {
             break;
         }
+        if(pool->next >= pool->emitted + pool->window) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
 
-        //int32_t keylen = qjson_strlen(pos);
-        char k[BUFLEN];
-        qjson_value_t *v = NULL;
-        str_unescape(pos, k, BUFLEN, parse_end);
-        pos = *parse_end;
+        struct qjson_dump_job *job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+        qjson_dump_job_run(job);
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-        while(isspace(*pos)) {
-            pos++;
-        }
+/*
+ * Serialize value with a pool of worker threads and pass the output to
+ * sink in order. Returns FAILURE as soon as sink returns non-zero.
+ */
+uint32_t qjson_dump_parallel(const qjson_value_t *value, const qjson_dump_options_t *options, qjson_sink_t sink, void *userdata) {
+    struct qjson_dump_pool pool;
+    qjson_dump_pool_plan(&pool, value, options);
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pthread_t *workers = malloc(pool.threads * sizeof(*workers));
+    uint32_t started = 0;
+    while(started < pool.threads && pthread_create(&workers[started], NULL, qjson_dump_worker, &pool) == 0) {
+        started++;
+    }
 
-        if(*pos++ != ':') {
-            *value = NULL;
-            *parse_end = pos;
-            return FAILURE;
+    uint32_t ret = SUCCESS;
+    for(size_t i = 0; i < pool.njobs; i++) {
+        struct qjson_dump_job *job = &pool.jobs[i];
+        pthread_mutex_lock(&pool.lock);
+        if(started == 0 && !job->done) {
+            /* no thread could be started: do the work here */
+            pool.next = i + 1;
+            pthread_mutex_unlock(&pool.lock);
+            qjson_dump_job_run(job);
+            pthread_mutex_lock(&pool.lock);
+            job->done = true;
         }
+        while(!job->done) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        pool.emitted = i + 1;
+        if(ret != SUCCESS) {
+            /* sink failed: let the workers drain without waiting on us */
+            pool.window = SIZE_MAX - pool.emitted;
+        }
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
 
-        while(isspace(*pos)) {
-            pos++;
+        if(ret == SUCCESS && job->out.len > 0 && sink(userdata, job->out.data, job->out.len) != 0) {
+            ret = FAILURE;
         }
+        qjson_buf_release(&job->out);
+    }
 
-        qjson_load(pos, &v, parse_end);
-        pos = *parse_end;
+    for(uint32_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    free(pool.jobs);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    return ret;
+}
 
-        qjson_object_append(obj, k, v);
+static int qjson_buf_sink(void *userdata, const char *data, size_t len) {
+    qjson_buf_put(userdata, data, len);
+    return 0;
+}
 
-        while(isspace(*pos)) {
-            pos++;
-        }
+/* qjson_dump_parallel into one malloc'd buffer; the caller frees it */
+char *qjson_dump_parallel_alloc(const qjson_value_t *value, const qjson_dump_options_t *options, size_t *len) {
+    qjson_buf_t b;
+    qjson_buf_init(&b);
+    qjson_buf_reserve(&b, 0);
+    b.data[0] = '\0';
+    qjson_dump_parallel(value, options, qjson_buf_sink, &b);
+    if(len != NULL) {
+        *len = b.len;
+    }
+    return b.data;
+}
 
-        if(*pos == ',') {
-            pos++;
-        } else if(*pos == '}'){
-            pos++;
-            break;
-        } else {
-            //TODO: free
-            *value = NULL;
-            *parse_end = pos;
-            return FAILURE;
+/*
+ * Streaming writer: emits JSON straight into a buffer without building a
+ * tree, using the same escaping and number formatting as qjson_dump. The
+ * nesting is one bit per level (set for objects), so the writer itself
+ * never allocates; with a sink the buffer is flushed every
+ * QJSON_WRITER_FLUSH bytes and reused. Call order (a key before each
+ * object member, matching ends) is checked unless NDEBUG is defined; a
+ * misuse makes the writer fail from then on.
+ */
+#define QJSON_WRITER_MAX_DEPTH  QJSON_DEFAULT_MAX_DEPTH
+#define QJSON_WRITER_FLUSH      4096
+
+struct qjson_writer {
+    qjson_buf_t buf;
+    qjson_sink_t sink;
+    void *userdata;
+
+    uint64_t objects[QJSON_WRITER_MAX_DEPTH / 64];
+    uint32_t depth;
+    bool first;         /* nothing written yet at this level */
+    bool after_key;     /* a key was written, its value is next */
+    uint32_t error;
+};
+typedef struct qjson_writer qjson_writer_t;
+
+/* sink NULL keeps the whole output in the writer's buffer */
+void qjson_writer_init(qjson_writer_t *w, uint32_t flags, qjson_sink_t sink, void *userdata) {
+    memset(w, 0, sizeof(*w));
+    qjson_buf_init(&w->buf);
+    w->buf.flags = flags;
+    w->sink = sink;
+    w->userdata = userdata;
+    w->first = true;
+}
+
+/* start over, keeping the buffer */
+void qjson_writer_reset(qjson_writer_t *w) {
+    w->buf.len = 0;
+    w->buf.truncated = false;
+    if(w->buf.data != NULL) {
+        w->buf.data[0] = '\0';
+    }
+    w->depth = 0;
+    w->first = true;
+    w->after_key = false;
+    w->error = SUCCESS;
+}
+
+void qjson_writer_release(qjson_writer_t *w) {
+    qjson_buf_release(&w->buf);
+}
+
+static inline bool qjson_writer_in_object(const qjson_writer_t *w) {
+    return w->depth > 0 && (w->objects[(w->depth - 1) / 64] >> ((w->depth - 1) % 64) & 1);
+}
+
+static void qjson_writer_flush(qjson_writer_t *w) {
+    if(w->sink != NULL && w->buf.len > 0 && w->error == SUCCESS) {
+        if(w->sink(w->userdata, w->buf.data, w->buf.len) != 0) {
+            w->error = FAILURE;
         }
+        w->buf.len = 0;
+        w->buf.data[0] = '\0';
     }
+}
 
+/* separator before a value; FAILURE if a value is not allowed here */
+static uint32_t qjson_writer_value_begin(qjson_writer_t *w) {
+    if(w->error != SUCCESS) {
+        return FAILURE;
+    }
+#ifndef NDEBUG
+    if(qjson_writer_in_object(w) != w->after_key || (w->depth == 0 && !w->first)) {
+        w->error = FAILURE;
+        return FAILURE;
+    }
+#endif
+    if(!w->first && !w->after_key) {
+        qjson_buf_put(&w->buf, ", ", 2);
+    }
+    w->first = false;
+    w->after_key = false;
+    return SUCCESS;
+}
 
-    *parse_end = pos;
-    *value = malloc(sizeof(*value));
-    (*value)->json_type = QJSON_OBJECT;
-    (*value)->v.object = obj;
+static uint32_t qjson_writer_value_end(qjson_writer_t *w) {
+    if(w->buf.len >= QJSON_WRITER_FLUSH) {
+        qjson_writer_flush(w);
+    }
+    return w->error;
+}
 
+static uint32_t qjson_writer_begin(qjson_writer_t *w, bool object) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    if(w->depth >= QJSON_WRITER_MAX_DEPTH) {
+        w->error = FAILURE;
+        return FAILURE;
+    }
+    uint64_t bit = (uint64_t)1 << (w->depth % 64);
+    if(object) {
+        w->objects[w->depth / 64] |= bit;
+    } else {
+        w->objects[w->depth / 64] &= ~bit;
+    }
+    w->depth++;
+    w->first = true;
+    qjson_buf_putc(&w->buf, object? '{': '[');
     return SUCCESS;
 }
 
+static uint32_t qjson_writer_end(qjson_writer_t *w, bool object) {
+    if(w->error != SUCCESS) {
+        return FAILURE;
+    }
+#ifndef NDEBUG
+    if(w->depth == 0 || qjson_writer_in_object(w) != object || w->after_key) {
+        w->error = FAILURE;
+        return FAILURE;
+    }
+#endif
+    w->depth--;
+    w->first = false;
+    qjson_buf_putc(&w->buf, object? '}': ']');
+    return qjson_writer_value_end(w);
+}
+
+uint32_t qjson_writer_begin_object(qjson_writer_t *w) {
+    return qjson_writer_begin(w, true);
+}
 
-uint32_t qjson_load_array(const char *str, qjson_value_t **value, const char **parse_end) {
-    if(*str != '[') {
-        *value = NULL;
-        *parse_end = str;
+uint32_t qjson_writer_end_object(qjson_writer_t *w) {
+    return qjson_writer_end(w, true);
+}
+
+uint32_t qjson_writer_begin_array(qjson_writer_t *w) {
+    return qjson_writer_begin(w, false);
+}
+
+uint32_t qjson_writer_end_array(qjson_writer_t *w) {
+    return qjson_writer_end(w, false);
+}
+
+uint32_t qjson_writer_keyn(qjson_writer_t *w, const char *key, uint32_t len) {
+    if(w->error != SUCCESS) {
+        return FAILURE;
+    }
+#ifndef NDEBUG
+    if(!qjson_writer_in_object(w) || w->after_key) {
+        w->error = FAILURE;
+        return FAILURE;
+    }
+#endif
+    if(!w->first) {
+        qjson_buf_put(&w->buf, ", ", 2);
+    }
+    w->first = false;
+    w->after_key = true;
+    qjson_buf_dump_string(&w->buf, key, len);
+    qjson_buf_put(&w->buf, ": ", 2);
+    return SUCCESS;
+}
+
+uint32_t qjson_writer_key(qjson_writer_t *w, const char *key) {
+    return qjson_writer_keyn(w, key, strlen(key));
+}
+
+uint32_t qjson_writer_stringn(qjson_writer_t *w, const char *str, uint32_t len) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    qjson_buf_dump_string(&w->buf, str, len);
+    return qjson_writer_value_end(w);
+}
+
+uint32_t qjson_writer_string(qjson_writer_t *w, const char *str) {
+    return qjson_writer_stringn(w, str, strlen(str));
+}
+
+uint32_t qjson_writer_int(qjson_writer_t *w, int64_t integer) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    qjson_buf_dump_int(&w->buf, integer);
+    return qjson_writer_value_end(w);
+}
+
+uint32_t qjson_writer_double(qjson_writer_t *w, double fraction) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    qjson_buf_dump_double(&w->buf, fraction);
+    return qjson_writer_value_end(w);
+}
+
+uint32_t qjson_writer_bool(qjson_writer_t *w, bool boolean) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
         return FAILURE;
     }
-    str++;
+    if(boolean) {
+        qjson_buf_put(&w->buf, "true", 4);
+    } else {
+        qjson_buf_put(&w->buf, "false", 5);
+    }
+    return qjson_writer_value_end(w);
+}
+
+uint32_t qjson_writer_null(qjson_writer_t *w) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    qjson_buf_put(&w->buf, "null", 4);
+    return qjson_writer_value_end(w);
+}
+
+/* number text written as is, e.g. a QJSON_NUMBER or an id too long for int64 */
+uint32_t qjson_writer_number(qjson_writer_t *w, const char *text, uint32_t len) {
+    bool is_float;
+    if(qjson_scan_number(text, text + len, &is_float) != text + len) {
+        w->error = FAILURE;
+        return FAILURE;
+    }
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    qjson_buf_put(&w->buf, text, len);
+    return qjson_writer_value_end(w);
+}
+
+/* a whole tree as one value */
+uint32_t qjson_writer_value(qjson_writer_t *w, const qjson_value_t *value) {
+    if(qjson_writer_value_begin(w) != SUCCESS) {
+        return FAILURE;
+    }
+    qjson_buf_dump_value(&w->buf, value);
+    return qjson_writer_value_end(w);
+}
+
+/*
+ * Flush what is left to the sink. FAILURE if the sink failed, the calls
+ * were out of order, or containers are still open.
+ */
+uint32_t qjson_writer_finish(qjson_writer_t *w) {
+    if(w->depth != 0 || w->after_key) {
+        w->error = FAILURE;
+    }
+    qjson_writer_flush(w);
+    return w->error;
+}
+
+/* output so far when there is no sink; NUL terminated */
+const char *qjson_writer_output(const qjson_writer_t *w, size_t *len) {
+    if(len != NULL) {
+        *len = w->buf.len;
+    }
+    return w->buf.data != NULL? w->buf.data: "";
+}
+
+
+
+static void *qjson_default_realloc(void *userdata, void *ptr, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void qjson_default_free(void *userdata, void *ptr) {
+    free(ptr);
+}
+
+void qjson_parser_init(qjson_parser_t *p, const qjson_parser_options_t *options) {
+    memset(p, 0, sizeof(*p));
+    p->max_depth = QJSON_DEFAULT_MAX_DEPTH;
+    p->allocator.realloc = qjson_default_realloc;
+    p->allocator.free = qjson_default_free;
+
+    if(options != NULL) {
+        if(options->max_depth != 0) {
+            p->max_depth = options->max_depth;
+        }
+        if(options->allocator != NULL) {
+            p->allocator = *options->allocator;
+        }
+        p->flags = options->flags;
+    }
+}
+
+void qjson_parser_release(qjson_parser_t *p) {
+    p->allocator.free(p->allocator.userdata, p->scratch);
+    p->allocator.free(p->allocator.userdata, p->stack);
+    p->scratch = NULL;
+    p->scratch_cap = 0;
+    p->stack = NULL;
+    p->stack_cap = 0;
+    p->depth = 0;
+}
+
+qjson_parser_t *qjson_parser_create(const qjson_parser_options_t *options) {
+    qjson_parser_t *p = malloc(sizeof(*p));
+    if(p == NULL) {
+        return NULL;
+    }
+    qjson_parser_init(p, options);
+    return p;
+}
+
+/* forget the previous document but keep scratch and stack capacity */
+void qjson_parser_reset(qjson_parser_t *p) {
+    p->depth = 0;
+}
+
+void qjson_parser_destroy(qjson_parser_t *p) {
+    if(p == NULL) {
+        return;
+    }
+    qjson_parser_release(p);
+    free(p);
+}
+
+static uint32_t qjson_parser_reserve(qjson_parser_t *p, uint32_t len) {
+    if(len <= p->scratch_cap) {
+        return SUCCESS;
+    }
+
+    uint32_t cap = MAX(p->scratch_cap * 2, 64);
+    while(cap < len) {
+        cap *= 2;
+    }
+    char *scratch = p->allocator.realloc(p->allocator.userdata, p->scratch, cap);
+    if(scratch == NULL) {
+        return FAILURE;
+    }
+    p->scratch = scratch;
+    p->scratch_cap = cap;
+    return SUCCESS;
+}
+
+static struct qjson_parser_frame *qjson_parser_push(qjson_parser_t *p, qjson_type_t json_type) {
+    if(p->depth >= p->max_depth) {
+        return NULL;
+    }
+
+    if(p->depth == p->stack_cap) {
+        uint32_t cap = MAX(p->stack_cap * 2, 16);
+        struct qjson_parser_frame *stack = p->allocator.realloc(p->allocator.userdata, p->stack, cap * sizeof(*stack));
+        if(stack == NULL) {
+            return NULL;
+        }
+        p->stack = stack;
+        p->stack_cap = cap;
+    }
+
+    struct qjson_parser_frame *frame = &p->stack[p->depth++];
+    frame->json_type = json_type;
+    return frame;
+}
+
+/*
+ * Unescape the string at str into the scratch buffer. The unescaped text
+ * is never longer than the quoted source, so one reserve covers it.
+ */
+static uint32_t qjson_parser_unescape(qjson_parser_t *p, const char *str, uint32_t *len, const char **parse_end) {
+    int32_t raw = qjson_strlen(str);
+    if(raw < 0 || str[raw] != '\"') {
+        *parse_end = str + MAX(raw, 0);
+        return FAILURE;
+    }
+
+    if(qjson_parser_reserve(p, raw + 1) != SUCCESS) {
+        *parse_end = str;
+        return FAILURE;
+    }
+
+    *len = str_unescape(str, p->scratch, raw + 1, parse_end);
+    if(*parse_end != str + raw + 1) {
+        return FAILURE;     /* left at the bad escape */
+    }
+    return SUCCESS;
+}
+
+static uint32_t qjson_parser_string(qjson_parser_t *p, const char *str, qjson_value_t *out, const char **parse_end) {
+    uint32_t len;
+    if(qjson_parser_unescape(p, str, &len, parse_end) != SUCCESS) {
+        return FAILURE;
+    }
+
+    out->json_type = QJSON_STRING;
+    out->len = len;
+    qjson_strbuf_set(&out->v.str, p->scratch, len);
+    return SUCCESS;
+}
+
+uint32_t qjson_load_string(const char *str, qjson_value_t **value, const char **parse_end) {
+    const char *pos = str;
+    while(isspace(*pos)) {
+        pos++;
+    }
+
+    if(*pos != '\"') {
+        *parse_end = pos;
+        return FAILURE;
+    }
+
+    qjson_parser_t p;
+    qjson_parser_init(&p, NULL);
+    qjson_value_t *string = malloc(sizeof(*string));
+    memset(string, 0, sizeof(*string));
+    uint32_t ret = qjson_parser_string(&p, pos, string, parse_end);
+    qjson_parser_release(&p);
+
+    if(ret != SUCCESS) {
+        free(string);
+        string = NULL;
+    }
+    *value = string;
+    return ret;
+}
+
+static uint32_t qjson_parse_bool(const char *str, qjson_value_t *out, const char **parse_end) {
+    bool result = false;
+    int parse_len = 0;
+    int false_len = strlen("false");
+    int true_len = strlen("true");
+
+    if(strncmp(str, "false", false_len)  == 0){
+        result = false;
+        parse_len = false_len;
+    } else if (strncmp(str, "true", true_len) ==0 ) {
+        result = true;
+        parse_len = true_len;
+    } else {
+        *parse_end = str;
+        return FAILURE;
+    }
+
+    out->json_type = QJSON_BOOL;
+    out->v.boolean = result;
+    *parse_end = str + parse_len;
+    return SUCCESS;
+}
+
+uint32_t qjson_load_bool(const char *str, qjson_value_t **value, const char **parse_end) {
+    qjson_value_t *boolean = malloc(sizeof(qjson_value_t));
+    memset(boolean, 0, sizeof(qjson_value_t));
+    if(qjson_parse_bool(str, boolean, parse_end) != SUCCESS) {
+        free(boolean);
+        *value = NULL;
+        return FAILURE;
+    }
+    *value = boolean;
+    return SUCCESS;
+}
+
+static uint32_t qjson_parse_null(const char *str, qjson_value_t *out, const char **parse_end) {
+    int null_len = strlen("null");
+    if(strncmp(str, "null", null_len) == 0){
+        out->json_type = QJSON_NULL;
+        *parse_end = str + null_len;
+        return SUCCESS;
+    }
+    *parse_end = str;
+    return FAILURE;
+}
+
+uint32_t qjson_load_null(const char *str, qjson_value_t **value, const char **parse_end) {
+    qjson_value_t *null = malloc(sizeof(qjson_value_t));
+    memset(null, 0, sizeof(qjson_value_t));
+    if(qjson_parse_null(str, null, parse_end) != SUCCESS) {
+        free(null);
+        *value = NULL;
+        return FAILURE;
+    }
+    *value = null;
+    return SUCCESS;
+}
+
+/* -?[0-9]+ spanning len bytes as int64; FAILURE if it does not fit */
+static uint32_t qjson_digits_int64(const char *str, size_t len, int64_t *integer) {
+    bool negative = len > 0 && *str == '-';
+    size_t pos = negative? 1: 0;
+    uint64_t limit = negative? (uint64_t)INT64_MAX + 1: INT64_MAX;
+    uint64_t acc = 0;
+
+    if(pos == len) {
+        return FAILURE;
+    }
+    for(; pos < len; pos++) {
+        unsigned digit = (unsigned char)str[pos] - '0';
+        if(digit > 9 || acc > (limit - digit) / 10) {
+            return FAILURE;
+        }
+        acc = acc * 10 + digit;
+    }
+    *integer = negative? (int64_t)(0 - acc): (int64_t)acc;
+    return SUCCESS;
+}
+
+/* FAILURE, with parse_end at str, when the digits do not fit an int64 */
+uint32_t qjson_load_integer(const char *str, int64_t *integer, const char **parse_end) {
+#define INTEGER_STR_MAX_LEN 20
+    size_t len = *str == '-'? 1: 0;
+    while(isdigit(str[len])) {
+        len++;
+    }
+
+    if(qjson_digits_int64(str, len, integer) != SUCCESS) {
+        *parse_end = str;
+        return FAILURE;
+    }
+    *parse_end = str + len;
+    return SUCCESS;
+}
+
+uint32_t qjson_load_fraction(const char *str, uint64_t *fraction, const char **parse_end) {
+    if(*str != '.') {
+        *fraction = 0;
+        *parse_end = str;
+        return FAILURE;
+    }
+
+    uint32_t rpos = 1;
+    uint32_t wpos = 0;
+    char buf[INTEGER_STR_MAX_LEN+1];
+    while(isdigit(str[rpos]) && wpos < INTEGER_STR_MAX_LEN) {
+        buf[wpos++] = str[rpos++];
+    }
+    buf[wpos] = '\0';
+    *fraction = strtoull(buf, NULL, 10);
+    return SUCCESS;
+}
+
+uint32_t qjson_load_exponent(const char *str, int32_t *exponent, const char **parse_end) {
+    if(*str != 'e' && *str != 'E') {
+        *exponent = 0;
+        *parse_end = str;
+        return FAILURE;
+    }
+
+    uint32_t rpos = 1;
+    uint32_t wpos = 0;
+    char buf[INTEGER_STR_MAX_LEN+1];
+
+    if(str[rpos] == '-') {
+		buf[wpos++] = str[rpos++];
+	} else if (str[rpos] == '+') {
+		rpos++;
+	} else {
+	}
+
+    while(isdigit(str[rpos]) && wpos < INTEGER_STR_MAX_LEN) {
+        buf[wpos++] = str[rpos++];
+    }
+    buf[wpos] = '\0';
+    *exponent = atoi(buf);
+    return SUCCESS;
+}
+
+static inline bool qjson_isdigit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
+
+/* the first byte at or after pos that is not a digit; end as for qjson_scan_number */
+static inline const char *qjson_skip_digits(const char *pos, const char *end) {
+    if(end == NULL) {
+        while(qjson_isdigit(*pos)) {
+            pos++;
+        }
+        return pos;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* eight at a time: digits are 0 to 9 once 0x30 is cleared, the high bit of a byte flags anything else */
+    while(end - pos >= 8) {
+        uint64_t word;
+        memcpy(&word, pos, 8);
+        word ^= 0x3030303030303030ULL;
+        uint64_t other = (((word & 0x7F7F7F7F7F7F7F7FULL) + 0x7676767676767676ULL) | word) & 0x8080808080808080ULL;
+        if(other != 0) {
+            return pos + __builtin_ctzll(other) / 8;
+        }
+        pos += 8;
+    }
+#endif
+    while(pos < end && qjson_isdigit(*pos)) {
+        pos++;
+    }
+    return pos;
+}
+
+/*
+ * Scan an RFC 8259 number: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+ * Returns the first byte after it, or NULL if str does not start with one.
+ * end bounds the input; NULL means it is NUL terminated.
+ */
+static const char *qjson_scan_number(const char *str, const char *end, bool *is_float) {
+#define PEEK(p) ((end == NULL || (p) < end)? *(p): '\0')
+    const char *pos = str;
+    *is_float = false;
+
+    if(PEEK(pos) == '-') {
+        pos++;
+    }
+    if(PEEK(pos) == '0') {
+        pos++;
+    } else if(qjson_isdigit(PEEK(pos))) {
+        pos = qjson_skip_digits(pos, end);
+    } else {
+        return NULL;
+    }
+
+    if(PEEK(pos) == '.') {
+        pos++;
+        if(!qjson_isdigit(PEEK(pos))) {
+            return NULL;
+        }
+        pos = qjson_skip_digits(pos, end);
+        *is_float = true;
+    }
+
+    if(PEEK(pos) == 'e' || PEEK(pos) == 'E') {
+        pos++;
+        if(PEEK(pos) == '+' || PEEK(pos) == '-') {
+            pos++;
+        }
+        if(!qjson_isdigit(PEEK(pos))) {
+            return NULL;
+        }
+        pos = qjson_skip_digits(pos, end);
+        *is_float = true;
+    }
+    return pos;
+#undef PEEK
+}
+
+static void qjson_number_raw(qjson_value_t *out, const char *str, uint32_t len, bool borrow) {
+    struct qjson_number *num = &out->v.number;
+    out->json_type = QJSON_NUMBER;
+    out->len = len;
+    num->cached.integer = 0;
+    if(len < QJSON_NUMBER_INLINE) {
+        memcpy(num->text.inline_text, str, len);
+        num->text.inline_text[len] = '\0';
+    } else if(borrow) {
+        num->text.ptr = str;
+    } else {
+        char *copy = malloc(len + 1);
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+        num->text.ptr = copy;
+        out->len |= QJSON_NUMBER_OWNED;
+    }
+}
+
+static inline const char *qjson_number_text(const qjson_value_t *value, uint32_t bits) {
+    return (bits & QJSON_NUMBER_LEN) < QJSON_NUMBER_INLINE? value->v.number.text.inline_text: value->v.number.text.ptr;
+}
+
+/* strtod over exactly len bytes: borrowed text runs on into the rest of the input */
+static double qjson_number_strtod(const char *text, uint32_t len) {
+    char small[64];
+    char *copy = len < sizeof(small)? small: malloc(len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    double fraction = strtod(copy, NULL);
+    if(copy != small) {
+        free(copy);
+    }
+    return fraction;
+}
+
+/*
+ * Convert a QJSON_NUMBER on first read and keep the result, returning its
+ * len bits. A shared tree is read from several threads at once: the
+ * result is stored before the flag that publishes it, and two readers
+ * converting together store the same bits.
+ */
+static uint32_t qjson_number_convert(const qjson_value_t *value) {
+    uint32_t bits = __atomic_load_n(&value->len, __ATOMIC_ACQUIRE);
+    if(bits & QJSON_NUMBER_CACHED) {
+        return bits;
+    }
+    const char *text = qjson_number_text(value, bits);
+    uint32_t len = bits & QJSON_NUMBER_LEN;
+    uint32_t kind = QJSON_NUMBER_CACHED;
+    int64_t cached;
+    if(qjson_digits_int64(text, len, &cached) == SUCCESS) {
+        kind |= QJSON_NUMBER_INT64;
+    } else {
+        double fraction = qjson_number_strtod(text, len);
+        memcpy(&cached, &fraction, sizeof(cached));
+    }
+    qjson_value_t *self = (qjson_value_t *)value;
+    __atomic_store_n(&self->v.number.cached.integer, cached, __ATOMIC_RELAXED);
+    return __atomic_or_fetch(&self->len, kind, __ATOMIC_RELEASE);
+}
+
+/* copy of a QJSON_NUMBER another thread may be converting; owned text is duplicated */
+static void qjson_number_copy(qjson_value_t *to, const qjson_value_t *from) {
+    uint32_t bits = __atomic_load_n(&from->len, __ATOMIC_ACQUIRE);
+    to->json_type = QJSON_NUMBER;
+    to->len = bits;
+    to->v.number.text = from->v.number.text;
+    to->v.number.cached.integer = __atomic_load_n(&from->v.number.cached.integer, __ATOMIC_RELAXED);
+    if(bits & QJSON_NUMBER_OWNED) {
+        uint32_t len = bits & QJSON_NUMBER_LEN;
+        char *copy = malloc(len + 1);
+        memcpy(copy, from->v.number.text.ptr, len + 1);
+        to->v.number.text.ptr = copy;
+    }
+}
+
+/* heap bytes behind a QJSON_NUMBER's text */
+static inline size_t qjson_number_size(const qjson_value_t *value) {
+    uint32_t bits = __atomic_load_n(&value->len, __ATOMIC_RELAXED);
+    return bits & QJSON_NUMBER_OWNED? (bits & QJSON_NUMBER_LEN) + 1: 0;
+}
+
+/*
+ * Integers that do not fit an int64 are kept as QJSON_NUMBER rather than
+ * truncated; with QJSON_PARSE_LAZY_NUMBERS every number is, and converted
+ * only when read.
+ */
+static uint32_t qjson_parse_number(const char *str, qjson_value_t *out, const char **parse_end, uint32_t flags) {
+    bool is_float;
+    const char *end = qjson_scan_number(str, NULL, &is_float);
+	if(end == NULL || end - str > QJSON_NUMBER_LEN) {
+		*parse_end = str;
+		return FAILURE;
+	}
+
+    bool borrow = flags & QJSON_PARSE_BORROW_INPUT;
+    if(flags & QJSON_PARSE_LAZY_NUMBERS) {
+        qjson_number_raw(out, str, end - str, borrow);
+    } else if(is_float) {
+        out->json_type = QJSON_FLOAT;
+        out->v.fraction = strtod(str, NULL);
+	} else if(qjson_digits_int64(str, end - str, &out->v.integer) == SUCCESS) {
+        out->json_type = QJSON_INT;
+	} else {
+        qjson_number_raw(out, str, end - str, borrow);
+    }
+    *parse_end = end;
+	return SUCCESS;
+}
+
+/* new QJSON_NUMBER holding a copy of the JSON number text, NULL if it is not one */
+qjson_value_t *qjson_create_number(const char *text, uint32_t len) {
+    bool is_float;
+    if(len > QJSON_NUMBER_LEN || qjson_scan_number(text, text + len, &is_float) != text + len) {
+        return NULL;
+    }
+    qjson_value_t *self = malloc(sizeof(*self));
+    memset(self, 0, sizeof(*self));
+    qjson_number_raw(self, text, len, false);
+    return self;
+}
+
+/*
+ * Source text of a QJSON_NUMBER, NULL with *len 0 for any other type.
+ * Text borrowed from the input is not NUL terminated.
+ */
+const char *qjson_value_number_text(const qjson_value_t *value, uint32_t *len) {
+    if(value->json_type != QJSON_NUMBER) {
+        if(len != NULL) {
+            *len = 0;
+        }
+        return NULL;
+    }
+    uint32_t bits = __atomic_load_n(&value->len, __ATOMIC_RELAXED);
+    if(len != NULL) {
+        *len = bits & QJSON_NUMBER_LEN;
+    }
+    return qjson_number_text(value, bits);
+}
+
+/* the value as an int64; FAILURE, with *integer 0, for fractions, exponents and out of range numbers */
+uint32_t qjson_value_int64(const qjson_value_t *value, int64_t *integer) {
+    if(value->json_type == QJSON_INT) {
+        *integer = value->v.integer;
+        return SUCCESS;
+    } else if(value->json_type == QJSON_NUMBER && (qjson_number_convert(value) & QJSON_NUMBER_INT64)) {
+        *integer = __atomic_load_n(&value->v.number.cached.integer, __ATOMIC_RELAXED);
+        return SUCCESS;
+    }
+    *integer = 0;
+    return FAILURE;
+}
+
+/* the value as a double, rounding integers and long numbers to nearest */
+uint32_t qjson_value_double(const qjson_value_t *value, double *fraction) {
+    switch(value->json_type) {
+    case QJSON_INT:
+        *fraction = value->v.integer;
+        return SUCCESS;
+    case QJSON_FLOAT:
+        *fraction = value->v.fraction;
+        return SUCCESS;
+    case QJSON_NUMBER: {
+        uint32_t bits = qjson_number_convert(value);
+        int64_t cached = __atomic_load_n(&value->v.number.cached.integer, __ATOMIC_RELAXED);
+        if(bits & QJSON_NUMBER_INT64) {
+            *fraction = cached;
+        } else {
+            memcpy(fraction, &cached, sizeof(*fraction));
+        }
+        return SUCCESS;
+    }
+    default:
+        *fraction = 0;
+        return FAILURE;
+    }
+}
+
+uint32_t qjson_load_number(const char *str, qjson_value_t **value, const char **parse_end) {
+	qjson_value_t *number = malloc(sizeof(*number));
+    memset(number, 0, sizeof(*number));
+    if(qjson_parse_number(str, number, parse_end, 0) != SUCCESS) {
+        free(number);
+        *value = NULL;
+        return FAILURE;
+    }
+    *value = number;
+	return SUCCESS;
+}
+
+
+static uint32_t qjson_parser_scalar(qjson_parser_t *p, const char *pos, qjson_value_t *out, const char **parse_end) {
+    if(*pos == '-' || isdigit(*pos)) {
+        return qjson_parse_number(pos, out, parse_end, p->flags);
+    } else if(*pos == '\"') {
+        return qjson_parser_string(p, pos, out, parse_end);
+    } else if(*pos == 't' || *pos == 'f'){
+        return qjson_parse_bool(pos, out, parse_end);
+    } else if(*pos == 'n') {
+        return qjson_parse_null(pos, out, parse_end);
+    }
+    *parse_end = pos;
+    return FAILURE;
+}
+
+/*
+ * Link a new member after the tail of the innermost open container and
+ * return the slot its value is parsed into. For objects this also reads
+ * the key and the ':' separator.
+ */
+static qjson_value_t *qjson_parser_member(qjson_parser_t *p, const char **parse_end) {
+    struct qjson_parser_frame *frame = &p->stack[p->depth - 1];
+    const char *pos = *parse_end;
+
+    if(frame->json_type == QJSON_ARRAY) {
+        if((p->flags & QJSON_PARSE_PACK_ARRAYS) &&
+           (frame->array->packed != QJSON_INVALID || frame->array->head.next == NULL)) {
+            /* may still be a column: hold the value until it is known */
+            memset(&p->pending, 0, sizeof(p->pending));
+            return &p->pending;
+        }
+        qjson_array_item_t *item = malloc(sizeof(*item));
+        memset(item, 0, sizeof(*item));
+        frame->tail.item->next = item;
+        frame->tail.item = item;
+        return &item->value;
+    }
+
+    while(isspace(*pos)) {
+        pos++;
+    }
+
+    uint32_t keylen;
+    if(*pos != '\"' || qjson_parser_unescape(p, pos, &keylen, parse_end) != SUCCESS) {
+        *parse_end = pos;
+        return NULL;
+    }
+    pos = *parse_end;
+
+    qjson_pair_t *pair = malloc(sizeof(*pair));
+    memset(pair, 0, sizeof(*pair));
+    pair->keylen = keylen;
+    qjson_strbuf_set(&pair->key, p->scratch, keylen);
+    frame->tail.pair->next = pair;
+    frame->tail.pair = pair;
+
+    while(isspace(*pos)) {
+        pos++;
+    }
+    if(*pos != ':') {
+        *parse_end = pos;
+        return NULL;
+    }
+    *parse_end = pos + 1;
+    return &pair->value;
+}
+
+/* unpack the innermost array and move the pending member into a new item */
+static qjson_value_t *qjson_parser_spill(qjson_parser_t *p) {
+    struct qjson_parser_frame *frame = &p->stack[p->depth - 1];
+    qjson_array_item_t *item = malloc(sizeof(*item));
+    item->value = p->pending;
+    item->next = NULL;
+    qjson_array_unpack(frame->array)->next = item;
+    frame->tail.item = item;
+    p->pending.json_type = QJSON_INVALID;
+    return &item->value;
+}
+
+/* store the pending member in the column when it fits there, or start one */
+static void qjson_parser_commit(qjson_parser_t *p) {
+    struct qjson_parser_frame *frame = &p->stack[p->depth - 1];
+    qjson_type_t type = p->pending.json_type;
+    if(qjson_array_packable(frame->array, &p->pending) ||
+       (frame->array->packed == QJSON_INVALID && frame->array->head.next == NULL &&
+        (type == QJSON_INT || type == QJSON_FLOAT))) {
+        qjson_array_column_push(frame->array, &p->pending);
+    } else {
+        qjson_parser_spill(p);
+    }
+}
+
+/*
+ * Parse one value into out. Nesting is handled with the context's
+ * container stack instead of recursion, so max_depth is the only limit
+ * on document depth. On failure out holds whatever was built so far and
+ * is safe to free.
+ */
+static uint32_t qjson_parser_value(qjson_parser_t *p, const char *str, qjson_value_t *out, const char **parse_end) {
+    const char *pos = str;
+    struct qjson_parser_frame *frame;
+
+    for(;;) {
+        while(isspace(*pos)) {
+            pos++;
+        }
+
+        if(*pos == '{' || *pos == '[') {
+            char close = *pos == '{'? '}': ']';
+            if(out == &p->pending) {
+                /* a container never goes into a column */
+                out = qjson_parser_spill(p);
+            }
+            frame = qjson_parser_push(p, *pos == '{'? QJSON_OBJECT: QJSON_ARRAY);
+            if(frame == NULL) {
+                *parse_end = pos;
+                return FAILURE;
+            }
+
+            if(frame->json_type == QJSON_OBJECT) {
+                out->json_type = QJSON_OBJECT;
+                out->v.object = qjson_create_object();
+                frame->tail.pair = &out->v.object->head;
+                frame->node = &out->v.object->node;
+            } else {
+                out->json_type = QJSON_ARRAY;
+                out->v.array = qjson_create_array();
+                frame->tail.item = &out->v.array->head;
+                frame->node = &out->v.array->node;
+                frame->array = out->v.array;
+            }
+            if(p->depth > 1) {
+                frame->node->parent = p->stack[p->depth - 2].node;
+            }
+
+            pos++;
+            while(isspace(*pos)) {
+                pos++;
+            }
+            if(*pos == close) {
+                pos++;
+                p->depth--;
+            } else {
+                out = qjson_parser_member(p, &pos);
+                if(out == NULL) {
+                    *parse_end = pos;
+                    return FAILURE;
+                }
+                continue;
+            }
+        } else if(qjson_parser_scalar(p, pos, out, &pos) != SUCCESS) {
+            if(out == &p->pending) {
+                qjson_value_clear(out);
+            }
+            *parse_end = pos;
+            return FAILURE;
+        } else if(out == &p->pending) {
+            qjson_parser_commit(p);
+        }
+
+        /* value complete: move to the next member or close containers */
+        out = NULL;
+        while(p->depth > 0) {
+            frame = &p->stack[p->depth - 1];
+            while(isspace(*pos)) {
+                pos++;
+            }
+
+            if(*pos == ',') {
+                pos++;
+                out = qjson_parser_member(p, &pos);
+                if(out == NULL) {
+                    *parse_end = pos;
+                    return FAILURE;
+                }
+                break;
+            } else if(*pos == (frame->json_type == QJSON_OBJECT? '}': ']')) {
+                pos++;
+                p->depth--;
+            } else {
+                *parse_end = pos;
+                return FAILURE;
+            }
+        }
+
+        if(out == NULL) {
+            *parse_end = pos;
+            return SUCCESS;
+        }
+    }
+}
+
+uint32_t qjson_parser_load(qjson_parser_t *p, const char *str, qjson_value_t **value, const char **parse_end) {
+    const char *end = str;
+    qjson_value_t *root = malloc(sizeof(*root));
+    memset(root, 0, sizeof(*root));
+
+    p->depth = 0;
+    uint32_t ret = qjson_parser_value(p, str, root, &end);
+    if(parse_end != NULL) {
+        *parse_end = end;
+    }
+
+    if(ret != SUCCESS) {
+        qjson_value_unref(root);
+        root = NULL;
+    }
+    *value = root;
+    return ret;
+}
+
+uint32_t qjson_load(const char *str, qjson_value_t **value, const char **parse_end) {
+    qjson_parser_t p;
+    qjson_parser_init(&p, NULL);
+    uint32_t ret = qjson_parser_load(&p, str, value, parse_end);
+    qjson_parser_release(&p);
+    return ret;
+}
+
+uint32_t qjson_load_object(const char *str, qjson_value_t **value, const char **parse_end) {
+    if(*str != '{') {
+        *value = NULL;
+        *parse_end = str;
+        return FAILURE;
+    }
+    return qjson_load(str, value, parse_end);
+}
+
+uint32_t qjson_load_array(const char *str, qjson_value_t **value, const char **parse_end) {
+    if(*str != '[') {
+        *value = NULL;
+        *parse_end = str;
+        return FAILURE;
+    }
+    return qjson_load(str, value, parse_end);
+}
+
+/*
+ * Validation without building a tree. UTF-8 is checked over the whole
+ * input first, 16 bytes at a time where SSSE3 is available, using the
+ * nibble lookup method of Keiser and Lemire ("Validating UTF-8 In Less
+ * Than One Instruction Per Byte"). The grammar walk then only has to
+ * look at ASCII structure, and skips over string bodies with SSE2.
+ */
+static bool qjson_utf8_scalar(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    while(i < len) {
+        if(i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        unsigned char c = s[i];
+        if(c < 0x80) {
+            i++;
+            continue;
+        }
+
+        uint32_t n, cp;
+        if(c >= 0xC2 && c <= 0xDF) {
+            n = 1;
+            cp = c & 0x1F;
+        } else if(c >= 0xE0 && c <= 0xEF) {
+            n = 2;
+            cp = c & 0x0F;
+        } else if(c >= 0xF0 && c <= 0xF4) {
+            n = 3;
+            cp = c & 0x07;
+        } else {
+            return false;
+        }
+        if(len - i <= n) {
+            return false;
+        }
+        for(uint32_t k = 1; k <= n; k++) {
+            if((s[i + k] & 0xC0) != 0x80) {
+                return false;
+            }
+            cp = (cp << 6) | (s[i + k] & 0x3F);
+        }
+        if(n == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) {
+            return false;
+        }
+        if(n == 3 && (cp < 0x10000 || cp > 0x10FFFF)) {
+            return false;
+        }
+        i += n + 1;
+    }
+    return true;
+}
+
+#ifdef QJSON_X86
+#define U8_TOO_SHORT        (1 << 0)
+#define U8_TOO_LONG         (1 << 1)
+#define U8_OVERLONG_3       (1 << 2)
+#define U8_TOO_LARGE        (1 << 3)
+#define U8_SURROGATE        (1 << 4)
+#define U8_OVERLONG_2       (1 << 5)
+#define U8_TOO_LARGE_1000   (1 << 6)
+#define U8_OVERLONG_4       (1 << 6)
+#define U8_TWO_CONTS        (1 << 7)
+#define U8_CARRY            (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+/* non-zero bytes where the sequences ending in in (preceded by prev) are invalid */
+__attribute__((target("ssse3")))
+static inline __m128i qjson_utf8_block(__m128i in, __m128i prev) {
+    const __m128i byte_1_high = _mm_setr_epi8(
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+    const __m128i byte_1_low = _mm_setr_epi8(
+        U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+        U8_CARRY | U8_OVERLONG_2,
+        U8_CARRY,
+        U8_CARRY,
+        U8_CARRY | U8_TOO_LARGE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+    const __m128i byte_2_high = _mm_setr_epi8(
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+
+    __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                      _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+    /* a third or fourth byte must be a continuation: only 111xxxxx leads reach 0x80 */
+    __m128i is_third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0xE0 - 0x80));
+    __m128i is_fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(is_third, is_fourth), _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, special);
+}
+
+__attribute__((target("ssse3")))
+static bool qjson_utf8_ssse3(const unsigned char *s, size_t len) {
+    /* a block ending in a lead byte needs the next block to finish it */
+    const __m128i max_tail = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m128i zero = _mm_setzero_si128();
+    __m128i prev = zero;
+    __m128i error = zero;
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+        if(_mm_movemask_epi8(in) == 0) {
+            error = _mm_or_si128(error, _mm_subs_epu8(prev, max_tail));
+        } else {
+            error = _mm_or_si128(error, qjson_utf8_block(in, prev));
+        }
+        prev = in;
+    }
+
+    unsigned char tail[16] = {0};
+    memcpy(tail, s + i, len - i);
+    __m128i in = _mm_loadu_si128((const __m128i *)tail);
+    error = _mm_or_si128(error, qjson_utf8_block(in, prev));
+    error = _mm_or_si128(error, qjson_utf8_block(zero, in));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) == 0xFFFF;
+}
+#endif
+
+static bool qjson_utf8_valid(const char *s, size_t len) {
+#ifdef QJSON_X86
+    if(__builtin_cpu_supports("ssse3")) {
+        return qjson_utf8_ssse3((const unsigned char *)s, len);
+    }
+#endif
+    return qjson_utf8_scalar((const unsigned char *)s, len);
+}
+
+static inline const char *qjson_validate_ws(const char *pos, const char *end) {
+    while(pos < end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t')) {
+        pos++;
+    }
+    return pos;
+}
+
+static inline bool qjson_ishex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* str points at the opening quote; returns the byte after the closing one */
+static const char *qjson_validate_string(const char *str, const char *end) {
+    const char *pos = str + 1;
+    for(;;) {
+#ifdef __SSE2__
+        /* skip plain bytes: not a quote, backslash or control character */
+        const __m128i quote = _mm_set1_epi8('\"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        while(pos + 16 <= end) {
+            __m128i in = _mm_loadu_si128((const __m128i *)pos);
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, quote), _mm_cmpeq_epi8(in, backslash)),
+                                           _mm_cmpeq_epi8(_mm_max_epu8(in, control), control));
+            int mask = _mm_movemask_epi8(special);
+            if(mask != 0) {
+                pos += __builtin_ctz(mask);
+                break;
+            }
+            pos += 16;
+        }
+#endif
+        if(pos >= end) {
+            return NULL;
+        }
+
+        unsigned char c = *pos;
+        if(c == '\"') {
+            return pos + 1;
+        } else if(c < 0x20) {
+            return NULL;
+        } else if(c == '\\') {
+            if(pos + 1 >= end) {
+                return NULL;
+            }
+            switch(pos[1]) {
+            case '\"': case '\\': case '/':
+            case 'b': case 'f': case 'n': case 'r': case 't':
+                pos += 2;
+                break;
+            case 'u':
+                if(end - pos < 6 || !qjson_ishex(pos[2]) || !qjson_ishex(pos[3]) ||
+                   !qjson_ishex(pos[4]) || !qjson_ishex(pos[5])) {
+                    return NULL;
+                }
+                pos += 6;
+                break;
+            default:
+                return NULL;
+            }
+        } else {
+            pos++;
+        }
+    }
+}
+
+static const char *qjson_validate_scalar(const char *pos, const char *end) {
+    bool is_float;
+    switch(*pos) {
+    case '\"':
+        return qjson_validate_string(pos, end);
+    case 't':
+        return end - pos >= 4 && memcmp(pos, "true", 4) == 0? pos + 4: NULL;
+    case 'f':
+        return end - pos >= 5 && memcmp(pos, "false", 5) == 0? pos + 5: NULL;
+    case 'n':
+        return end - pos >= 4 && memcmp(pos, "null", 4) == 0? pos + 4: NULL;
+    default:
+        return qjson_scan_number(pos, end, &is_float);
+    }
+}
+
+/* an object member up to its value: "key" ws ':' */
+static const char *qjson_validate_key(const char *pos, const char *end) {
+    pos = qjson_validate_ws(pos, end);
+    if(pos >= end || *pos != '\"') {
+        return NULL;
+    }
+    pos = qjson_validate_string(pos, end);
+    if(pos == NULL) {
+        return NULL;
+    }
+    pos = qjson_validate_ws(pos, end);
+    if(pos >= end || *pos != ':') {
+        return NULL;
+    }
+    return pos + 1;
+}
+
+/*
+ * Check the grammar of one value at pos (after optional whitespace) and
+ * return the byte after it, NULL if it is not well formed. Nesting deeper
+ * than QJSON_DEFAULT_MAX_DEPTH is rejected, as qjson_load would reject it.
+ */
+static const char *qjson_validate_value(const char *pos, const char *end) {
+    uint64_t objects[QJSON_DEFAULT_MAX_DEPTH / 64] = {0};   /* bit set: object, clear: array */
+    uint32_t depth = 0;
+
+    for(;;) {
+        pos = qjson_validate_ws(pos, end);
+        if(pos >= end) {
+            return NULL;
+        }
+
+        if(*pos == '{' || *pos == '[') {
+            if(depth >= QJSON_DEFAULT_MAX_DEPTH) {
+                return NULL;
+            }
+            bool is_object = *pos == '{';
+            if(is_object) {
+                objects[depth / 64] |= 1ULL << (depth % 64);
+            } else {
+                objects[depth / 64] &= ~(1ULL << (depth % 64));
+            }
+            depth++;
+
+            pos = qjson_validate_ws(pos + 1, end);
+            if(pos < end && *pos == (is_object? '}': ']')) {
+                pos++;
+                depth--;
+            } else {
+                if(is_object && (pos = qjson_validate_key(pos, end)) == NULL) {
+                    return NULL;
+                }
+                continue;
+            }
+        } else if((pos = qjson_validate_scalar(pos, end)) == NULL) {
+            return NULL;
+        }
+
+        /* value complete: move to the next member or close containers */
+        bool more = false;
+        while(depth > 0) {
+            bool is_object = objects[(depth - 1) / 64] & (1ULL << ((depth - 1) % 64));
+            pos = qjson_validate_ws(pos, end);
+            if(pos >= end) {
+                return NULL;
+            }
+
+            if(*pos == ',') {
+                pos++;
+                if(is_object && (pos = qjson_validate_key(pos, end)) == NULL) {
+                    return NULL;
+                }
+                more = true;
+                break;
+            } else if(*pos == (is_object? '}': ']')) {
+                pos++;
+                depth--;
+            } else {
+                return NULL;
+            }
+        }
+
+        if(!more) {
+            return pos;
+        }
+    }
+}
+
+/*
+ * Check that buf holds exactly one RFC 8259 JSON text in well-formed
+ * UTF-8, without allocating.
+ */
+uint32_t qjson_validate(const char *buf, size_t len) {
+    const char *end = buf + len;
+    if(!qjson_utf8_valid(buf, len)) {
+        return FAILURE;
+    }
+    const char *pos = qjson_validate_value(buf, end);
+    return pos != NULL && qjson_validate_ws(pos, end) == end? SUCCESS: FAILURE;
+}
+
+
+/*
+ * Schema-compiled parsing: a field table describes a C struct and is
+ * compiled once into a perfect hash of its member names. Loading walks
+ * the input and stores every known member straight into the struct
+ * without building a tree; unknown members are skipped with the
+ * validator. qjson_schema_dump writes the same struct back through a
+ * qjson_writer_t.
+ *
+ *     struct point { int64_t x, y; char *label; };
+ *     static const qjson_field_t point_fields[] = {
+ *         QJSON_FIELD(struct point, x, QJSON_FIELD_INT64),
+ *         QJSON_FIELD(struct point, y, QJSON_FIELD_INT64),
+ *         QJSON_FIELD(struct point, label, QJSON_FIELD_STRING),
+ *     };
+ */
+enum qjson_field_type {
+    QJSON_FIELD_INT64,      /* int64_t */
+    QJSON_FIELD_INT32,      /* int32_t */
+    QJSON_FIELD_DOUBLE,     /* double */
+    QJSON_FIELD_BOOL,       /* bool */
+    QJSON_FIELD_STRING,     /* char *, malloc'd; NULL reads and writes as null */
+    QJSON_FIELD_OBJECT,     /* embedded struct described by schema */
+};
+typedef enum qjson_field_type qjson_field_type_t;
+
+struct qjson_schema;
+
+struct qjson_field {
+    const char *name;
+    size_t offset;
+    qjson_field_type_t type;
+    const struct qjson_schema *schema;
+};
+typedef struct qjson_field qjson_field_t;
+
+#define QJSON_FIELD(st, member, type) {#member, offsetof(st, member), type, NULL}
+#define QJSON_FIELD_STRUCT(st, member, schema) {#member, offsetof(st, member), QJSON_FIELD_OBJECT, schema}
+
+/* hash slot: field is the index into fields plus one, 0 when empty */
+struct qjson_schema_key {
+    uint32_t len;
+    uint32_t field;
+};
+
+struct qjson_schema {
+    const qjson_field_t *fields;
+    uint32_t nfields;
+    uint32_t seed;
+    uint32_t mask;
+    struct qjson_schema_key keys[];
+};
+typedef struct qjson_schema qjson_schema_t;
+
+static inline uint32_t qjson_schema_hash(const char *key, uint32_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for(uint32_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/*
+ * Compile nfields fields into a schema. The fields (and their nested
+ * schemas) must outlive it. NULL if two fields share a name.
+ */
+qjson_schema_t *qjson_schema_compile(const qjson_field_t *fields, uint32_t nfields) {
+    for(uint32_t i = 0; i < nfields; i++) {
+        for(uint32_t k = 0; k < i; k++) {
+            if(strcmp(fields[i].name, fields[k].name) == 0) {
+                return NULL;
+            }
+        }
+    }
+
+    /* look for a seed that puts every name in its own slot, growing the table if none does */
+    uint32_t size = 4;
+    while(size < nfields * 2) {
+        size *= 2;
+    }
+    for(;; size *= 2) {
+        qjson_schema_t *schema = malloc(sizeof(*schema) + size * sizeof(schema->keys[0]));
+        schema->fields = fields;
+        schema->nfields = nfields;
+        schema->mask = size - 1;
+        for(schema->seed = 0; schema->seed < 256; schema->seed++) {
+            memset(schema->keys, 0, size * sizeof(schema->keys[0]));
+            uint32_t i;
+            for(i = 0; i < nfields; i++) {
+                uint32_t len = strlen(fields[i].name);
+                struct qjson_schema_key *key = &schema->keys[qjson_schema_hash(fields[i].name, len, schema->seed) & schema->mask];
+                if(key->field != 0) {
+                    break;
+                }
+                key->len = len;
+                key->field = i + 1;
+            }
+            if(i == nfields) {
+                return schema;
+            }
+        }
+        free(schema);
+    }
+}
+
+void qjson_schema_destroy(qjson_schema_t *schema) {
+    free(schema);
+}
+
+static inline const qjson_field_t *qjson_schema_find(const qjson_schema_t *schema, const char *key, uint32_t len) {
+    const struct qjson_schema_key *slot = &schema->keys[qjson_schema_hash(key, len, schema->seed) & schema->mask];
+    if(slot->field == 0 || slot->len != len) {
+        return NULL;
+    }
+    const qjson_field_t *field = &schema->fields[slot->field - 1];
+    return memcmp(field->name, key, len) == 0? field: NULL;
+}
+
+/*
+ * The string at str (opening quote) as a NUL terminated body: pointed to
+ * in place when it has no escapes, else unescaped into the scratch buffer.
+ * Returns the byte after the closing quote, NULL if it is not well formed.
+ */
+static const char *qjson_schema_string(qjson_parser_t *p, const char *str, const char *end, const char **body, uint32_t *len) {
+    const char *after = qjson_validate_string(str, end);
+    if(after == NULL) {
+        return NULL;
+    }
+    uint32_t raw = after - str - 2;
+    if(memchr(str + 1, '\\', raw) == NULL) {
+        *body = str + 1;
+        *len = raw;
+        return after;
+    }
+
+    const char *unescaped_end;
+    if(qjson_parser_reserve(p, raw + 2) != SUCCESS) {
+        return NULL;
+    }
+    *len = str_unescape(str, p->scratch, raw + 2, &unescaped_end);
+    *body = p->scratch;
+    return after;
+}
+
+static const char *qjson_schema_object(qjson_parser_t *p, const qjson_schema_t *schema, const char *pos, const char *end,
+                                       char *base, const char **fail);
+
+static const char *qjson_schema_field(qjson_parser_t *p, const qjson_field_t *field, const char *pos, const char *end,
+                                      char *to, const char **fail) {
+    const char *after;
+    const char *body;
+    uint32_t len;
+    bool is_float;
+
+    *fail = pos;
+    if(end - pos >= 4 && memcmp(pos, "null", 4) == 0) {
+        /* the member keeps its current value */
+        return pos + 4;
+    }
+
+    switch(field->type) {
+    case QJSON_FIELD_INT64:
+    case QJSON_FIELD_INT32: {
+        int64_t integer;
+        after = qjson_scan_number(pos, end, &is_float);
+        if(after == NULL || is_float || qjson_digits_int64(pos, after - pos, &integer) != SUCCESS) {
+            return NULL;
+        }
+        if(field->type == QJSON_FIELD_INT64) {
+            memcpy(to, &integer, sizeof(integer));
+        } else if(integer >= INT32_MIN && integer <= INT32_MAX) {
+            int32_t small = integer;
+            memcpy(to, &small, sizeof(small));
+        } else {
+            return NULL;
+        }
+        return after;
+    }
+    case QJSON_FIELD_DOUBLE: {
+        /* strtod wants a terminator the input may not have */
+        after = qjson_scan_number(pos, end, &is_float);
+        if(after == NULL || qjson_parser_reserve(p, after - pos + 1) != SUCCESS) {
+            return NULL;
+        }
+        memcpy(p->scratch, pos, after - pos);
+        p->scratch[after - pos] = '\0';
+        double fraction = strtod(p->scratch, NULL);
+        memcpy(to, &fraction, sizeof(fraction));
+        return after;
+    }
+    case QJSON_FIELD_BOOL:
+        if(end - pos >= 4 && memcmp(pos, "true", 4) == 0) {
+            *(bool *)to = true;
+            return pos + 4;
+        } else if(end - pos >= 5 && memcmp(pos, "false", 5) == 0) {
+            *(bool *)to = false;
+            return pos + 5;
+        }
+        return NULL;
+    case QJSON_FIELD_STRING: {
+        if(*pos != '\"' || (after = qjson_schema_string(p, pos, end, &body, &len)) == NULL) {
+            return NULL;
+        }
+        char *str = malloc(len + 1);
+        memcpy(str, body, len);
+        str[len] = '\0';
+        free(*(char **)to);
+        *(char **)to = str;
+        return after;
+    }
+    case QJSON_FIELD_OBJECT:
+        return qjson_schema_object(p, field->schema, pos, end, to, fail);
+    default:
+        return NULL;
+    }
+}
+
+static const char *qjson_schema_object(qjson_parser_t *p, const qjson_schema_t *schema, const char *pos, const char *end,
+                                       char *base, const char **fail) {
+    const char *body;
+    uint32_t len;
+
+    pos = qjson_validate_ws(pos, end);
+    *fail = pos;
+    if(pos >= end || *pos != '{') {
+        return NULL;
+    }
+    pos = qjson_validate_ws(pos + 1, end);
+    if(pos < end && *pos == '}') {
+        return pos + 1;
+    }
+
+    for(;;) {
+        *fail = pos;
+        if(pos >= end || *pos != '\"' || (pos = qjson_schema_string(p, pos, end, &body, &len)) == NULL) {
+            return NULL;
+        }
+        const qjson_field_t *field = qjson_schema_find(schema, body, len);
+
+        pos = qjson_validate_ws(pos, end);
+        *fail = pos;
+        if(pos >= end || *pos != ':') {
+            return NULL;
+        }
+        pos = qjson_validate_ws(pos + 1, end);
+        *fail = pos;
+        if(field != NULL) {
+            pos = qjson_schema_field(p, field, pos, end, base + field->offset, fail);
+        } else {
+            pos = qjson_validate_value(pos, end);
+        }
+        if(pos == NULL) {
+            return NULL;
+        }
+
+        pos = qjson_validate_ws(pos, end);
+        *fail = pos;
+        if(pos < end && *pos == ',') {
+            pos = qjson_validate_ws(pos + 1, end);
+        } else if(pos < end && *pos == '}') {
+            return pos + 1;
+        } else {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Parse the object in buf into the struct at out. out must be zeroed or
+ * hold an earlier load: members missing from the input (or null) keep
+ * their value, and replaced strings are freed. p only lends its scratch
+ * buffer. On failure out may be partly filled; release it with
+ * qjson_schema_free.
+ */
+uint32_t qjson_schema_load(qjson_parser_t *p, const qjson_schema_t *schema, const char *buf, size_t len, void *out,
+                           const char **parse_end) {
+    const char *end = buf + len;
+    const char *fail = buf;
+    const char *pos = qjson_schema_object(p, schema, buf, end, out, &fail);
+    if(pos == NULL || (pos = qjson_validate_ws(pos, end)) != end) {
+        if(parse_end != NULL) {
+            *parse_end = pos == NULL? fail: pos;
+        }
+        return FAILURE;
+    }
+    if(parse_end != NULL) {
+        *parse_end = pos;
+    }
+    return SUCCESS;
+}
+
+/* free the strings a load stored in obj */
+void qjson_schema_free(const qjson_schema_t *schema, void *obj) {
+    for(uint32_t i = 0; i < schema->nfields; i++) {
+        const qjson_field_t *field = &schema->fields[i];
+        char *member = (char *)obj + field->offset;
+        if(field->type == QJSON_FIELD_STRING) {
+            free(*(char **)member);
+            *(char **)member = NULL;
+        } else if(field->type == QJSON_FIELD_OBJECT) {
+            qjson_schema_free(field->schema, member);
+        }
+    }
+}
+
+/* write obj as an object with the fields in table order */
+uint32_t qjson_schema_dump(const qjson_schema_t *schema, const void *obj, qjson_writer_t *w) {
+    qjson_writer_begin_object(w);
+    for(uint32_t i = 0; i < schema->nfields; i++) {
+        const qjson_field_t *field = &schema->fields[i];
+        const char *member = (const char *)obj + field->offset;
+        int64_t integer;
+        int32_t small;
+        double fraction;
+        const char *str;
+
+        qjson_writer_key(w, field->name);
+        switch(field->type) {
+        case QJSON_FIELD_INT64:
+            memcpy(&integer, member, sizeof(integer));
+            qjson_writer_int(w, integer);
+            break;
+        case QJSON_FIELD_INT32:
+            memcpy(&small, member, sizeof(small));
+            qjson_writer_int(w, small);
+            break;
+        case QJSON_FIELD_DOUBLE:
+            memcpy(&fraction, member, sizeof(fraction));
+            qjson_writer_double(w, fraction);
+            break;
+        case QJSON_FIELD_BOOL:
+            qjson_writer_bool(w, *(const bool *)member);
+            break;
+        case QJSON_FIELD_STRING:
+            str = *(char * const *)member;
+            if(str != NULL) {
+                qjson_writer_string(w, str);
+            } else {
+                qjson_writer_null(w);
+            }
+            break;
+        case QJSON_FIELD_OBJECT:
+            qjson_schema_dump(field->schema, member, w);
+            break;
+        }
+    }
+    return qjson_writer_end_object(w);
+}
+
+void qjson_array_unref(qjson_array_t *arr);
+void qjson_object_unref(qjson_object_t *obj);
+
+/* release what value owns, leaving it QJSON_INVALID */
+static void qjson_value_clear(qjson_value_t *value) {
+    switch(value->json_type) {
+    case QJSON_STRING:
+        qjson_strbuf_free(&value->v.str, value->len);
+        break;
+    case QJSON_NUMBER:
+        if(value->len & QJSON_NUMBER_OWNED) {
+            free((char *)value->v.number.text.ptr);
+        }
+        break;
+    case QJSON_ARRAY:
+        qjson_array_unref(value->v.array);
+        break;
+    case QJSON_OBJECT:
+        qjson_object_unref(value->v.object);
+        break;
+    default:
+        break;
+    }
+    value->json_type = QJSON_INVALID;
+}
+
+/*
+ * Shallow copy: containers are shared by taking a reference, only long
+ * strings (which are not reference counted) are duplicated.
+ */
+static void qjson_value_copy(qjson_value_t *to, const qjson_value_t *from) {
+    if(from->json_type == QJSON_NUMBER) {
+        qjson_number_copy(to, from);
+        return;
+    }
+    *to = *from;
+    switch(from->json_type) {
+    case QJSON_STRING:
+        if(from->len >= QJSON_SSO_SIZE) {
+            qjson_strbuf_set(&to->v.str, from->v.str.heap, from->len);
+        }
+        break;
+    case QJSON_ARRAY:
+        qjson_node_ref(&from->v.array->node);
+        break;
+    case QJSON_OBJECT:
+        qjson_node_ref(&from->v.object->node);
+        break;
+    default:
+        break;
+    }
+}
+
+/* new handle sharing value's containers; release it with qjson_value_unref */
+qjson_value_t *qjson_value_ref(const qjson_value_t *value) {
+    qjson_value_t *self = malloc(sizeof(*self));
+    qjson_value_copy(self, value);
+    return self;
+}
+
+void qjson_value_unref(qjson_value_t *value) {
+    if(value == NULL) {
+        return;
+    }
+    qjson_value_clear(value);
+    free(value);
+}
+
+/*
+ * Keep serialized bytes for every container in value's subtree, and for
+ * containers added to it later. qjson_dump copies clean containers from
+ * their cache and only formats the ones modified since the last dump.
+ */
+void qjson_cache_enable(const qjson_value_t *value) {
+    struct qjson_node *node = qjson_value_node(value);
+    if(node == NULL || (__atomic_load_n(&node->flags, __ATOMIC_RELAXED) & QJSON_NODE_CACHE)) {
+        return;
+    }
+    __atomic_fetch_or(&node->flags, QJSON_NODE_CACHE, __ATOMIC_RELAXED);
+
+    if(value->json_type == QJSON_ARRAY) {
+        for(qjson_array_item_t *item = value->v.array->head.next; item != NULL; item = item->next) {
+            qjson_cache_enable(&item->value);
+        }
+    } else {
+        for(qjson_pair_t *pair = value->v.object->head.next; pair != NULL; pair = pair->next) {
+            qjson_cache_enable(&pair->value);
+        }
+    }
+}
+
+/* slot has just been stored in owner, which holds a reference to it */
+static void qjson_node_link(struct qjson_node *owner, const qjson_value_t *slot) {
+    struct qjson_node *child = qjson_value_node(slot);
+    if(child == NULL) {
+        return;
+    }
+    struct qjson_node *expected = NULL;
+    __atomic_compare_exchange_n(&child->parent, &expected, owner, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&owner->flags, __ATOMIC_RELAXED) & QJSON_NODE_CACHE) {
+        qjson_cache_enable(slot);
+    }
+}
+
+/*
+ * owner drops the value in slot. If owner was the recorded parent of a
+ * container that somebody else still holds, that holder is unknown, so
+ * the container is frozen: it will be copied rather than modified in
+ * place, and no cache that includes it can go stale.
+ */
+static void qjson_node_detach(struct qjson_node *owner, qjson_value_t *slot) {
+    struct qjson_node *child = qjson_value_node(slot);
+    if(child != NULL && __atomic_load_n(&child->parent, __ATOMIC_RELAXED) == owner) {
+        __atomic_store_n(&child->parent, NULL, __ATOMIC_RELAXED);
+        if(qjson_node_shared(child)) {
+            __atomic_fetch_or(&child->flags, QJSON_NODE_FROZEN, __ATOMIC_RELAXED);
+        }
+    }
+    qjson_value_clear(slot);
+}
+
+/*
+ * A shared container was copied for one of its holders, which may or may
+ * not be the recorded parent. The parent keeps the original unchanged, so
+ * its cache stays valid; if the parent is the one that moved on, it
+ * replaces the copy through the slot and that drops its cache. Either
+ * way the link is no longer trusted, so the container is frozen.
+ */
+static void qjson_node_orphan(struct qjson_node *node) {
+    if(__atomic_exchange_n(&node->parent, NULL, __ATOMIC_RELAXED) != NULL) {
+        __atomic_fetch_or(&node->flags, QJSON_NODE_FROZEN, __ATOMIC_RELAXED);
+    }
+}
+
+static void qjson_node_release(struct qjson_node *node) {
+    qjson_fragment_free(__atomic_load_n(&node->cache, __ATOMIC_RELAXED));
+}
+
+/* free ptr unless it lives in block */
+static inline void qjson_block_free(struct qjson_block *block, void *ptr) {
+    if(block == NULL) {
+        free(ptr);
+    }
+}
+
+static void qjson_block_unref(struct qjson_block *block) {
+    if(block != NULL && __atomic_sub_fetch(&block->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(block);
+    }
+}
+
+
+qjson_array_t *qjson_create_array() {
+    qjson_array_t *self = malloc(sizeof(*self));
+    memset(self, 0, sizeof(*self));
+    qjson_node_init(&self->node);
+    return self;
+}
+
+void qjson_array_unref(qjson_array_t *arr) {
+    if(arr == NULL || !qjson_node_unref(&arr->node)) {
+        return;
+    }
+    /* in a block only child containers are released on their own */
+    struct qjson_block *block = arr->node.block;
+    qjson_block_free(block, arr->column.ints);
+    qjson_array_item_t *item = arr->head.next;
+    while(item != NULL) {
+        qjson_array_item_t *next = item->next;
+        if(block == NULL || qjson_value_node(&item->value) != NULL) {
+            qjson_node_detach(&arr->node, &item->value);
+        }
+        qjson_block_free(block, item);
+        item = next;
+    }
+    qjson_node_release(&arr->node);
+    qjson_block_free(block, arr);
+    qjson_block_unref(block);
+}
+
+static qjson_array_t *qjson_array_clone(const qjson_array_t *arr) {
+    qjson_array_t *self = qjson_create_array();
+    self->node.flags = arr->node.flags & QJSON_NODE_CACHE;
+    if(arr->packed != QJSON_INVALID) {
+        self->packed = arr->packed;
+        self->count = self->cap = arr->count;
+        self->column.ints = malloc(arr->count * sizeof(*arr->column.ints));
+        memcpy(self->column.ints, arr->column.ints, arr->count * sizeof(*arr->column.ints));
+        return self;
+    }
+    qjson_array_item_t *tail = &self->head;
+    for(qjson_array_item_t *item = arr->head.next; item != NULL; item = item->next) {
+        qjson_array_item_t *copy = malloc(sizeof(*copy));
+        qjson_value_copy(&copy->value, &item->value);
+        qjson_node_link(&self->node, &copy->value);
+        copy->next = NULL;
+        tail->next = copy;
+        tail = copy;
+    }
+    return self;
+}
+
+/*
+ * Copy-on-write: a shared array is never modified in place. The caller's
+ * reference moves to a private copy whose items share the children.
+ * A private array is modified in place and the cached bytes of it and
+ * its ancestors are dropped.
+ */
+static qjson_array_t *qjson_array_mut(qjson_array_t *arr) {
+    if(qjson_node_private(&arr->node)) {
+        qjson_node_invalidate(&arr->node);
+        return arr;
+    }
+    qjson_array_t *copy = qjson_array_clone(arr);
+    qjson_node_orphan(&arr->node);
+    qjson_array_unref(arr);
+    return copy;
+}
+
+/* e can go into arr's column: arr is packed with e's type */
+static bool qjson_array_packable(const qjson_array_t *arr, const qjson_value_t *e) {
+    return arr->packed != QJSON_INVALID && arr->packed == e->json_type;
+}
+
+static void qjson_array_column_push(qjson_array_t *arr, const qjson_value_t *e) {
+    if(arr->count == arr->cap) {
+        arr->cap = MAX(arr->cap * 2, 16);
+        arr->column.ints = realloc(arr->column.ints, arr->cap * sizeof(*arr->column.ints));
+    }
+    if(e->json_type == QJSON_INT) {
+        arr->column.ints[arr->count++] = e->v.integer;
+    } else {
+        arr->column.doubles[arr->count++] = e->v.fraction;
+    }
+    arr->packed = e->json_type;
+}
+
+/* turn a packed array back into an item list; returns the last item */
+static qjson_array_item_t *qjson_array_unpack(qjson_array_t *arr) {
+    qjson_array_item_t *tail = &arr->head;
+    while(tail->next != NULL) {
+        tail = tail->next;
+    }
+    if(arr->packed == QJSON_INVALID) {
+        return tail;
+    }
+
+    for(size_t i = 0; i < arr->count; i++) {
+        qjson_array_item_t *item = malloc(sizeof(*item));
+        memset(item, 0, sizeof(*item));
+        item->value.json_type = arr->packed;
+        if(arr->packed == QJSON_INT) {
+            item->value.v.integer = arr->column.ints[i];
+        } else {
+            item->value.v.fraction = arr->column.doubles[i];
+        }
+        tail->next = item;
+        tail = item;
+    }
+    free(arr->column.ints);
+    arr->column.ints = NULL;
+    arr->count = arr->cap = 0;
+    arr->packed = QJSON_INVALID;
+    return tail;
+}
+
+static qjson_value_t *qjson_array_push(qjson_array_t *arr) {
+    qjson_array_item_t *cur = &arr->head;
+    while(cur->next != NULL) {
+        cur = cur->next;
+    }
+    qjson_array_item_t *item = malloc(sizeof(*item));
+    item->next = NULL;
+
+    cur->next = item;
+    return &item->value;
+}
+
+/*
+ * The mutating functions return the array to use from now on: when arr is
+ * shared it is copied first, like realloc. e is shared, not consumed.
+ * Store a copied child back with qjson_object_set or qjson_array_append
+ * (or reach it with qjson_value_get_mut in the first place) so its new
+ * parent is recorded.
+ */
+qjson_array_t *qjson_array_append(qjson_array_t *arr, const qjson_value_t *e) {
+    arr = qjson_array_mut(arr);
+    if(qjson_array_packable(arr, e)) {
+        qjson_array_column_push(arr, e);
+        return arr;
+    }
+    qjson_array_unpack(arr);
+    qjson_value_t *slot = qjson_array_push(arr);
+    qjson_value_copy(slot, e);
+    qjson_node_link(&arr->node, slot);
+    return arr;
+}
+
+/* like qjson_array_append, but takes over e, which must come from malloc */
+qjson_array_t *qjson_array_append_new(qjson_array_t *arr, qjson_value_t *e) {
+    arr = qjson_array_mut(arr);
+    if(qjson_array_packable(arr, e)) {
+        qjson_array_column_push(arr, e);
+        free(e);
+        return arr;
+    }
+    qjson_array_unpack(arr);
+    qjson_value_t *slot = qjson_array_push(arr);
+    *slot = *e;
+    free(e);
+    qjson_node_link(&arr->node, slot);
+    return arr;
+}
+
+/*
+ * Move the members of an item list that holds only ints or only floats
+ * into a column. Returns the array to use from now on, like the other
+ * mutating functions; arr is returned untouched when it is empty,
+ * already packed or has members of another kind.
+ */
+qjson_array_t *qjson_array_pack(qjson_array_t *arr) {
+    qjson_array_item_t *first = arr->head.next;
+    if(first == NULL || (first->value.json_type != QJSON_INT && first->value.json_type != QJSON_FLOAT)) {
+        return arr;
+    }
+    for(qjson_array_item_t *item = first->next; item != NULL; item = item->next) {
+        if(item->value.json_type != first->value.json_type) {
+            return arr;
+        }
+    }
+
+    arr = qjson_array_mut(arr);
+    qjson_array_item_t *item = arr->head.next;
+    arr->head.next = NULL;
+    while(item != NULL) {
+        qjson_array_item_t *next = item->next;
+        qjson_array_column_push(arr, &item->value);
+        free(item);
+        item = next;
+    }
+    return arr;
+}
+
+uint32_t qjson_array_length(qjson_array_t *arr) {
+    qjson_array_item_t *cur = arr->head.next;
+    uint32_t count = arr->count;
+
+    while(cur != NULL) {
+        cur = cur->next;
+        count++;
+    }
+    return count;
+}
+
+/* QJSON_INT or QJSON_FLOAT when arr is packed, QJSON_INVALID otherwise */
+qjson_type_t qjson_array_packed_type(const qjson_array_t *arr) {
+    return arr->packed;
+}
+
+/* the column of a packed int array, NULL with *count 0 if arr is not one */
+const int64_t *qjson_array_ints(const qjson_array_t *arr, size_t *count) {
+    if(arr->packed != QJSON_INT) {
+        *count = 0;
+        return NULL;
+    }
+    *count = arr->count;
+    return arr->column.ints;
+}
+
+const double *qjson_array_doubles(const qjson_array_t *arr, size_t *count) {
+    if(arr->packed != QJSON_FLOAT) {
+        *count = 0;
+        return NULL;
+    }
+    *count = arr->count;
+    return arr->column.doubles;
+}
+
+
+qjson_object_t *qjson_create_object() {
+    qjson_object_t *self = malloc(sizeof(*self));
+    memset(self, 0, sizeof(*self));
+    qjson_node_init(&self->node);
+    return self;
+}
+
+void qjson_object_unref(qjson_object_t *obj) {
+    if(obj == NULL || !qjson_node_unref(&obj->node)) {
+        return;
+    }
+    struct qjson_block *block = obj->node.block;
+    qjson_pair_t *pair = obj->head.next;
+    while(pair != NULL) {
+        qjson_pair_t *next = pair->next;
+        if(block == NULL) {
+            qjson_strbuf_free(&pair->key, pair->keylen);
+        }
+        if(block == NULL || qjson_value_node(&pair->value) != NULL) {
+            qjson_node_detach(&obj->node, &pair->value);
+        }
+        qjson_block_free(block, pair);
+        pair = next;
+    }
+    qjson_node_release(&obj->node);
+    qjson_block_free(block, obj);
+    qjson_block_unref(block);
+}
+
+static qjson_object_t *qjson_object_clone(const qjson_object_t *obj) {
+    qjson_object_t *self = qjson_create_object();
+    self->node.flags = obj->node.flags & QJSON_NODE_CACHE;
+    qjson_pair_t *tail = &self->head;
+    for(qjson_pair_t *pair = obj->head.next; pair != NULL; pair = pair->next) {
+        qjson_pair_t *copy = malloc(sizeof(*copy));
+        copy->keylen = pair->keylen;
+        qjson_strbuf_set(&copy->key, qjson_pair_key(pair), pair->keylen);
+        qjson_value_copy(&copy->value, &pair->value);
+        qjson_node_link(&self->node, &copy->value);
+        copy->next = NULL;
+        tail->next = copy;
+        tail = copy;
+    }
+    return self;
+}
+
+static qjson_object_t *qjson_object_mut(qjson_object_t *obj) {
+    if(qjson_node_private(&obj->node)) {
+        qjson_node_invalidate(&obj->node);
+        return obj;
+    }
+    qjson_object_t *copy = qjson_object_clone(obj);
+    qjson_node_orphan(&obj->node);
+    qjson_object_unref(obj);
+    return copy;
+}
+
+static qjson_pair_t *qjson_object_find(const qjson_object_t *obj, const char *key, uint32_t keylen) {
+    for(qjson_pair_t *pair = obj->head.next; pair != NULL; pair = pair->next) {
+        if(pair->keylen == keylen && memcmp(qjson_pair_key(pair), key, keylen) == 0) {
+            return pair;
+        }
+    }
+    return NULL;
+}
+
+/* borrowed pointer to the value stored under key, NULL if absent */
+const qjson_value_t *qjson_object_get(const qjson_object_t *obj, const char *key) {
+    qjson_pair_t *pair = qjson_object_find(obj, key, strlen(key));
+    return pair != NULL? &pair->value: NULL;
+}
+
+static qjson_value_t *qjson_object_push(qjson_object_t *obj, const char *key, uint32_t keylen) {
+    qjson_pair_t *pair = malloc(sizeof(qjson_pair_t));
+    pair->keylen = keylen;
+    qjson_strbuf_set(&pair->key, key, keylen);
+    pair->next = NULL;
+
+    qjson_pair_t *last = &obj->head;
+    while(last->next != NULL){
+        last = last->next;
+    }
+    last->next = pair;
+    return &pair->value;
+}
+
+qjson_object_t *qjson_object_append(qjson_object_t *obj, const char *key, const qjson_value_t *e) {
+    obj = qjson_object_mut(obj);
+    qjson_value_t *slot = qjson_object_push(obj, key, strlen(key));
+    qjson_value_copy(slot, e);
+    qjson_node_link(&obj->node, slot);
+    return obj;
+}
+
+qjson_object_t *qjson_object_append_new(qjson_object_t *obj, const char *key, qjson_value_t *e) {
+    obj = qjson_object_mut(obj);
+    qjson_value_t *slot = qjson_object_push(obj, key, strlen(key));
+    *slot = *e;
+    free(e);
+    qjson_node_link(&obj->node, slot);
+    return obj;
+}
+
+/* replace the value stored under key, appending the key if it is absent */
+qjson_object_t *qjson_object_set(qjson_object_t *obj, const char *key, const qjson_value_t *e) {
+    uint32_t keylen = strlen(key);
+    obj = qjson_object_mut(obj);
+
+    qjson_pair_t *pair = qjson_object_find(obj, key, keylen);
+    if(pair == NULL) {
+        qjson_value_t *slot = qjson_object_push(obj, key, keylen);
+        qjson_value_copy(slot, e);
+        qjson_node_link(&obj->node, slot);
+        return obj;
+    }
+
+    /* e may live inside the old value, so copy before releasing it */
+    qjson_value_t old = pair->value;
+    qjson_value_copy(&pair->value, e);
+    qjson_node_link(&obj->node, &pair->value);
+    qjson_node_detach(&obj->node, &old);
+    return obj;
+}
+
+qjson_object_t *qjson_object_set_new(qjson_object_t *obj, const char *key, qjson_value_t *e) {
+    uint32_t keylen = strlen(key);
+    obj = qjson_object_mut(obj);
+
+    qjson_value_t *slot;
+    qjson_pair_t *pair = qjson_object_find(obj, key, keylen);
+    if(pair == NULL) {
+        slot = qjson_object_push(obj, key, keylen);
+    } else {
+        slot = &pair->value;
+        qjson_node_detach(&obj->node, slot);
+    }
+    *slot = *e;
+    free(e);
+    qjson_node_link(&obj->node, slot);
+    return obj;
+}
+
+/* make the container held in slot (a member of owner) private to owner */
+static void qjson_slot_mut(struct qjson_node *owner, qjson_value_t *slot) {
+    struct qjson_node *child = qjson_value_node(slot);
+    if(child == NULL || qjson_node_private(child)) {
+        return;
+    }
+
+    qjson_value_t old = *slot;
+    if(slot->json_type == QJSON_ARRAY) {
+        slot->v.array = qjson_array_clone(old.v.array);
+    } else {
+        slot->v.object = qjson_object_clone(old.v.object);
+    }
+    qjson_node_link(owner, slot);
+    qjson_node_detach(owner, &old);
+}
+
+/*
+ * Slot of the member key of the object held by value, ready to be
+ * modified in place; NULL if value is not an object or has no such key.
+ * value is a root handle or a slot returned by an earlier call, so a path
+ * of nested members can be followed: every container on the way is made
+ * private (copied only if shared) and its cached bytes are dropped.
+ */
+qjson_value_t *qjson_value_get_mut(qjson_value_t *value, const char *key) {
+    if(value->json_type != QJSON_OBJECT) {
+        return NULL;
+    }
+    value->v.object = qjson_object_mut(value->v.object);
+
+    qjson_pair_t *pair = qjson_object_find(value->v.object, key, strlen(key));
+    if(pair == NULL) {
+        return NULL;
+    }
+    qjson_slot_mut(&value->v.object->node, &pair->value);
+    return &pair->value;
+}
+
+/* like qjson_value_get_mut, for the item at index of an array */
+qjson_value_t *qjson_value_at_mut(qjson_value_t *value, uint32_t index) {
+    if(value->json_type != QJSON_ARRAY) {
+        return NULL;
+    }
+    value->v.array = qjson_array_mut(value->v.array);
+    qjson_array_unpack(value->v.array);       /* the caller may store anything in the slot */
+
+    qjson_array_item_t *item = value->v.array->head.next;
+    while(item != NULL && index-- > 0) {
+        item = item->next;
+    }
+    if(item == NULL) {
+        return NULL;
+    }
+    qjson_slot_mut(&value->v.array->node, &item->value);
+    return &item->value;
+}
+
+
+/*
+ * Bytes held by a tree, by kind. These are the sizes asked of malloc (or
+ * taken in a compacted block), without allocator overhead. A container
+ * reached through several paths is counted on each of them.
+ */
+struct qjson_memory_usage {
+    size_t objects;     /* qjson_object_t */
+    size_t arrays;      /* qjson_array_t */
+    size_t pairs;       /* qjson_pair_t */
+    size_t items;       /* qjson_array_item_t */
+    size_t columns;     /* numbers of packed arrays */
+    size_t strings;     /* strings, number text and keys too long to be inline */
+    size_t caches;      /* serialized bytes kept for QJSON_NODE_CACHE */
+    size_t total;
+};
+typedef struct qjson_memory_usage qjson_memory_usage_t;
+
+static inline size_t qjson_strbuf_size(uint32_t len) {
+    return len >= QJSON_SSO_SIZE? len + 1: 0;
+}
+
+static void qjson_memory_add(const qjson_value_t *value, qjson_memory_usage_t *usage) {
+    struct qjson_node *node = qjson_value_node(value);
+    if(node == NULL) {
+        if(value->json_type == QJSON_STRING) {
+            usage->strings += qjson_strbuf_size(value->len);
+        } else if(value->json_type == QJSON_NUMBER) {
+            usage->strings += qjson_number_size(value);
+        }
+        return;
+    }
+
+    for(struct qjson_fragment *frag = __atomic_load_n(&node->cache, __ATOMIC_ACQUIRE); frag != NULL; frag = frag->next) {
+        usage->caches += sizeof(*frag) + frag->len;
+    }
+    if(value->json_type == QJSON_ARRAY) {
+        const qjson_array_t *arr = value->v.array;
+        usage->arrays += sizeof(*arr);
+        usage->columns += arr->cap * sizeof(*arr->column.ints);
+        for(const qjson_array_item_t *item = arr->head.next; item != NULL; item = item->next) {
+            usage->items += sizeof(*item);
+            qjson_memory_add(&item->value, usage);
+        }
+    } else {
+        const qjson_object_t *obj = value->v.object;
+        usage->objects += sizeof(*obj);
+        for(const qjson_pair_t *pair = obj->head.next; pair != NULL; pair = pair->next) {
+            usage->pairs += sizeof(*pair);
+            usage->strings += qjson_strbuf_size(pair->keylen);
+            qjson_memory_add(&pair->value, usage);
+        }
+    }
+}
+
+/* what value owns, not counting the qjson_value_t itself */
+void qjson_memory_usage(const qjson_value_t *value, qjson_memory_usage_t *usage) {
+    memset(usage, 0, sizeof(*usage));
+    qjson_memory_add(value, usage);
+    usage->total = usage->objects + usage->arrays + usage->pairs + usage->items +
+                   usage->columns + usage->strings + usage->caches;
+}
+
+/*
+ * Compaction copies a tree into one block in depth-first order: each
+ * container is followed by its members, each member by its long string
+ * or its own subtree. Containers that are shared with other trees stay
+ * where they are and are referenced, since their memory cannot be freed.
+ */
+#define QJSON_BLOCK_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+struct qjson_compact {
+    struct qjson_block *block;
+    char *pos;
+};
+
+static void *qjson_compact_take(struct qjson_compact *c, size_t n) {
+    void *p = c->pos;
+    c->pos += QJSON_BLOCK_ALIGN(n);
+    return p;
+}
+
+/*
+ * Bytes value's members need in the block. Shared containers are counted
+ * too: another holder may let go of one before it is reached, and then
+ * it is copied after all.
+ */
+static size_t qjson_compact_size(const qjson_value_t *value) {
+    size_t size = 0;
+    switch(value->json_type) {
+    case QJSON_STRING:
+        return QJSON_BLOCK_ALIGN(qjson_strbuf_size(value->len));
+    case QJSON_NUMBER:
+        return QJSON_BLOCK_ALIGN(qjson_number_size(value));
+    case QJSON_ARRAY:
+        size = QJSON_BLOCK_ALIGN(sizeof(qjson_array_t));
+        size += QJSON_BLOCK_ALIGN(value->v.array->count * sizeof(*value->v.array->column.ints));
+        for(const qjson_array_item_t *item = value->v.array->head.next; item != NULL; item = item->next) {
+            size += QJSON_BLOCK_ALIGN(sizeof(*item)) + qjson_compact_size(&item->value);
+        }
+        return size;
+    case QJSON_OBJECT:
+        size = QJSON_BLOCK_ALIGN(sizeof(qjson_object_t));
+        for(const qjson_pair_t *pair = value->v.object->head.next; pair != NULL; pair = pair->next) {
+            size += QJSON_BLOCK_ALIGN(sizeof(*pair)) + QJSON_BLOCK_ALIGN(qjson_strbuf_size(pair->keylen));
+            size += qjson_compact_size(&pair->value);
+        }
+        return size;
+    default:
+        return 0;
+    }
+}
+
+static void qjson_compact_node(struct qjson_compact *c, struct qjson_node *node, const struct qjson_node *from,
+                               struct qjson_node *parent) {
+    memset(node, 0, sizeof(*node));
+    node->refcount = 1;
+    node->flags = (from->flags & QJSON_NODE_CACHE) | QJSON_NODE_FROZEN;
+    node->parent = parent;
+    node->block = c->block;
+    c->block->refcount++;
+}
+
+static void qjson_compact_value(struct qjson_compact *c, qjson_value_t *to, const qjson_value_t *from, struct qjson_node *parent) {
+    *to = *from;
+    switch(from->json_type) {
+    case QJSON_NUMBER:
+        /* owned text moves into the block, borrowed text stays in the input */
+        if(from->len & QJSON_NUMBER_OWNED) {
+            char *text = qjson_compact_take(c, qjson_number_size(from));
+            memcpy(text, from->v.number.text.ptr, qjson_number_size(from));
+            to->v.number.text.ptr = text;
+        }
+        break;
+    case QJSON_STRING:
+        if(from->len >= QJSON_SSO_SIZE) {
+            to->v.str.heap = qjson_compact_take(c, from->len + 1);
+            memcpy(to->v.str.heap, from->v.str.heap, from->len + 1);
+        }
+        break;
+    case QJSON_ARRAY: {
+        const qjson_array_t *arr = from->v.array;
+        if(qjson_node_shared(&arr->node)) {
+            qjson_node_ref(&from->v.array->node);
+            break;
+        }
+        qjson_array_t *self = qjson_compact_take(c, sizeof(*self));
+        memset(self, 0, sizeof(*self));
+        qjson_compact_node(c, &self->node, &arr->node, parent);
+        to->v.array = self;
+        if(arr->packed != QJSON_INVALID) {
+            self->packed = arr->packed;
+            self->count = self->cap = arr->count;
+            self->column.ints = qjson_compact_take(c, arr->count * sizeof(*arr->column.ints));
+            memcpy(self->column.ints, arr->column.ints, arr->count * sizeof(*arr->column.ints));
+        }
+        qjson_array_item_t *tail = &self->head;
+        for(const qjson_array_item_t *item = arr->head.next; item != NULL; item = item->next) {
+            qjson_array_item_t *copy = qjson_compact_take(c, sizeof(*copy));
+            copy->next = NULL;
+            qjson_compact_value(c, &copy->value, &item->value, &self->node);
+            tail->next = copy;
+            tail = copy;
+        }
+        break;
+    }
+    case QJSON_OBJECT: {
+        const qjson_object_t *obj = from->v.object;
+        if(qjson_node_shared(&obj->node)) {
+            qjson_node_ref(&from->v.object->node);
+            break;
+        }
+        qjson_object_t *self = qjson_compact_take(c, sizeof(*self));
+        memset(self, 0, sizeof(*self));
+        qjson_compact_node(c, &self->node, &obj->node, parent);
+        to->v.object = self;
+        qjson_pair_t *tail = &self->head;
+        for(const qjson_pair_t *pair = obj->head.next; pair != NULL; pair = pair->next) {
+            qjson_pair_t *copy = qjson_compact_take(c, sizeof(*copy));
+            copy->next = NULL;
+            copy->keylen = pair->keylen;
+            copy->key = pair->key;
+            if(pair->keylen >= QJSON_SSO_SIZE) {
+                copy->key.heap = qjson_compact_take(c, pair->keylen + 1);
+                memcpy(copy->key.heap, pair->key.heap, pair->keylen + 1);
+            }
+            qjson_compact_value(c, &copy->value, &pair->value, &self->node);
+            tail->next = copy;
+            tail = copy;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/*
+ * Move the tree under value into one block and free the scattered
+ * originals. The compacted containers are frozen: modifying one through
+ * the API copies it out of the block first. FAILURE if value's own
+ * container is shared, as nothing could be freed.
+ */
+uint32_t qjson_compact(qjson_value_t *value) {
+    struct qjson_node *node = qjson_value_node(value);
+    if(node == NULL) {
+        return SUCCESS;
+    }
+    if(qjson_node_shared(node)) {
+        return FAILURE;
+    }
+
+    size_t size = qjson_compact_size(value);
+    struct qjson_compact c;
+    c.block = malloc(sizeof(*c.block) + size);
+    c.block->refcount = 0;
+    c.block->size = size;
+    c.pos = c.block->data;
+
+    qjson_value_t compacted;
+    qjson_compact_value(&c, &compacted, value, NULL);
+    qjson_value_clear(value);
+    *value = compacted;
+    return SUCCESS;
+}
+
+
+/*
+ * Bulk ingestion: a reader thread loads files while parser threads turn
+ * the loaded ones into trees, each with its own reusable context. Reads
+ * go through io_uring where the kernel offers it, several files in
+ * flight at once, and through plain read() on the reader thread
+ * otherwise. At most depth files are being read, waiting, parsed or
+ * waiting for qjson_ingest_next at any time, so a slow consumer stalls
+ * the reader instead of letting memory grow. Results arrive in
+ * completion order; each carries the index of its path.
+ */
+#define QJSON_INGEST_DEPTH      64
+#define QJSON_INGEST_NO_URING   0x1     /* always use the read() fallback */
+
+/* largest single read request; bigger files are read in several */
+#define QJSON_INGEST_READ_MAX   (1u << 30)
+
+struct qjson_ingest_options {
+    uint32_t workers;                       /* parser threads, 0: one per online CPU */
+    uint32_t depth;                         /* files in the pipeline, 0: QJSON_INGEST_DEPTH */
+    uint32_t flags;                         /* QJSON_INGEST_* */
+    const qjson_parser_options_t *parser;   /* for every worker's context */
+};
+typedef struct qjson_ingest_options qjson_ingest_options_t;
+
+struct qjson_ingest_result {
+    size_t index;           /* position in the paths array */
+    const char *path;
+    qjson_value_t *value;   /* NULL on failure, else released by the caller with qjson_value_unref */
+    int error;              /* errno if the file could not be read, 0 otherwise */
+    size_t error_offset;    /* where parsing stopped, when it failed */
+};
+typedef struct qjson_ingest_result qjson_ingest_result_t;
+
+struct qjson_ingest_file {
+    struct qjson_ingest_file *next;
+    size_t index;
+    int fd;
+    int error;
+    char *data;
+    size_t len;             /* bytes read so far */
+    size_t size;            /* bytes expected */
+    qjson_value_t *value;
+    size_t error_offset;
+};
+
+struct qjson_ingest_queue {
+    struct qjson_ingest_file *head;
+    struct qjson_ingest_file *tail;
+};
+
+#ifdef QJSON_IO_URING
+struct qjson_uring {
+    int fd;
+    uint32_t entries;
+    uint32_t unsubmitted;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+#endif
+
+struct qjson_ingest {
+    const char *const *paths;
+    size_t npaths;
+    qjson_ingest_options_t options;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct qjson_ingest_queue loaded;   /* waiting for a parser */
+    struct qjson_ingest_queue parsed;   /* waiting for qjson_ingest_next */
+    uint32_t free_slots;
+    size_t produced;    /* files handed to the parsers */
+    size_t delivered;
+    bool reader_done;
+    bool stop;
+
+    pthread_t reader;
+    pthread_t *workers;
+    uint32_t started;
+    bool uring;
+#ifdef QJSON_IO_URING
+    struct qjson_uring ring;
+#endif
+};
+typedef struct qjson_ingest qjson_ingest_t;
+
+static void qjson_ingest_push(struct qjson_ingest_queue *q, struct qjson_ingest_file *f) {
+    f->next = NULL;
+    if(q->tail != NULL) {
+        q->tail->next = f;
+    } else {
+        q->head = f;
+    }
+    q->tail = f;
+}
+
+static struct qjson_ingest_file *qjson_ingest_pop(struct qjson_ingest_queue *q) {
+    struct qjson_ingest_file *f = q->head;
+    if(f != NULL) {
+        q->head = f->next;
+        if(q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return f;
+}
+
+static void qjson_ingest_file_free(struct qjson_ingest_file *f) {
+    free(f->data);
+    qjson_value_unref(f->value);
+    free(f);
+}
+
+/* take a pipeline slot; without wait only if one is free. false once stopping */
+static bool qjson_ingest_slot(qjson_ingest_t *in, bool wait) {
+    bool taken = false;
+    pthread_mutex_lock(&in->lock);
+    while(!in->stop && in->free_slots == 0 && wait) {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    if(!in->stop && in->free_slots > 0) {
+        in->free_slots--;
+        taken = true;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return taken;
+}
+
+/* hand a read file (or one that failed to read) to the parsers */
+static void qjson_ingest_loaded(qjson_ingest_t *in, struct qjson_ingest_file *f) {
+    if(f->fd >= 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    if(f->error == 0) {
+        f->data[f->len] = '\0';
+    }
+    pthread_mutex_lock(&in->lock);
+    qjson_ingest_push(&in->loaded, f);
+    in->produced++;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+}
+
+/* open path index and size its buffer; a failure is recorded in the file */
+static struct qjson_ingest_file *qjson_ingest_open(qjson_ingest_t *in, size_t index) {
+    struct qjson_ingest_file *f = malloc(sizeof(*f));
+    memset(f, 0, sizeof(*f));
+    f->index = index;
+    f->fd = open(in->paths[index], O_RDONLY | O_CLOEXEC);
+
+    struct stat st;
+    if(f->fd < 0 || fstat(f->fd, &st) != 0) {
+        f->error = errno;
+        return f;
+    }
+    f->size = st.st_size;
+    f->data = malloc(f->size + 1);
+    return f;
+}
+
+/* read the rest of f with read(); the fallback, and the way out of a refused io_uring read */
+static void qjson_ingest_read_sync(struct qjson_ingest_file *f) {
+    while(f->error == 0 && f->len < f->size) {
+        ssize_t n = read(f->fd, f->data + f->len, MIN(f->size - f->len, QJSON_INGEST_READ_MAX));
+        if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n < 0) {
+            f->error = errno;
+        } else if(n == 0) {
+            break;      /* shrank since fstat */
+        } else {
+            f->len += n;
+        }
+    }
+}
+
+/* read the files from first on with read() */
+static void qjson_ingest_read_from(qjson_ingest_t *in, size_t first) {
+    for(size_t i = first; i < in->npaths && qjson_ingest_slot(in, true); i++) {
+        struct qjson_ingest_file *f = qjson_ingest_open(in, i);
+        qjson_ingest_read_sync(f);
+        qjson_ingest_loaded(in, f);
+    }
+}
+
+#ifdef QJSON_IO_URING
+/*
+ * Minimal io_uring over the raw system calls: one submission and one
+ * completion ring, used only by the reader thread.
+ */
+static uint32_t qjson_uring_init(struct qjson_uring *ring, uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) {
+        return FAILURE;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return FAILURE;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if(ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_size);
+        }
+        munmap(ring->sq_ring, ring->sq_size);
+        close(ring->fd);
+        return FAILURE;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return SUCCESS;
+}
+
+static void qjson_uring_release(struct qjson_uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_size);
+    }
+    munmap(ring->sq_ring, ring->sq_size);
+    close(ring->fd);
+}
 
-    const char *pos = str;
-    qjson_array_t *array = qjson_create_array();
-    while(*pos != ']' && *pos != '\0') {
+/* queue a read of the rest of f, tagged for the completion; the caller keeps fewer than entries in flight */
+static void qjson_uring_read(struct qjson_uring *ring, struct qjson_ingest_file *f, uint32_t tag) {
+    uint32_t tail = *ring->sq_tail;
+    uint32_t idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = f->fd;
+    sqe->addr = (uintptr_t)(f->data + f->len);
+    sqe->len = MIN(f->size - f->len, QJSON_INGEST_READ_MAX);
+    sqe->off = f->len;
+    sqe->user_data = tag;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
 
-        while(isspace(*pos)) {
-            pos++;
+/* submit what is queued and wait for at least one completion */
+static uint32_t qjson_uring_wait(struct qjson_uring *ring) {
+    for(;;) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(ret >= 0) {
+            ring->unsubmitted -= MIN((uint32_t)ret, ring->unsubmitted);
+            return SUCCESS;
         }
+        if(errno != EINTR) {
+            return FAILURE;
+        }
+    }
+}
 
-        uint32_t ret;
-        qjson_value_t *item = NULL;
-        ret = qjson_load(pos, &item, parse_end);
-
-        printf("======= ret = %lu\n", ret);
-        qjson_array_append(array, item);
+/*
+ * The ring refused a submit or a wait, with errno set. Reads it never
+ * took are done with read(); reads it took are waited for without
+ * submitting and finished with read(). If even that wait fails the
+ * files are failed to the consumer, and their buffers are leaked since
+ * the kernel may still write into them.
+ */
+static void qjson_ingest_uring_abort(qjson_ingest_t *in, struct qjson_ingest_file **flight, uint32_t inflight) {
+    struct qjson_uring *ring = &in->ring;
+    int error = errno;
+
+    uint32_t taken = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for(uint32_t pos = taken; pos != *ring->sq_tail; pos++) {
+        uint32_t tag = ring->sqes[ring->sq_array[pos & *ring->sq_mask]].user_data;
+        qjson_ingest_read_sync(flight[tag]);
+        qjson_ingest_loaded(in, flight[tag]);
+        flight[tag] = NULL;
+        inflight--;
+    }
+    __atomic_store_n(ring->sq_tail, taken, __ATOMIC_RELEASE);
+    ring->unsubmitted = 0;
 
-        pos = *parse_end;
-        while(isspace(*pos)) {
-            pos++;
-        }
+    uint32_t head, tail;
 
-        if(*pos == ',') {
-            pos++;
-        } else if(*pos == ']'){
-            pos++;
+    while(inflight > 0) {
+        if(syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            error = errno;
             break;
-        } else {
-            //TODO: free array
-            *value = NULL;
-            *parse_end = pos;
-            return FAILURE;
         }
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            struct qjson_ingest_file *f = flight[cqe->user_data];
+            flight[cqe->user_data] = NULL;
+            inflight--;
+            if(cqe->res > 0) {
+                f->len += cqe->res;
+            } else if(cqe->res < 0 && cqe->res != -EINVAL && cqe->res != -EOPNOTSUPP &&
+                      cqe->res != -EINTR && cqe->res != -EAGAIN) {
+                f->error = -cqe->res;
+            }
+            qjson_ingest_read_sync(f);
+            qjson_ingest_loaded(in, f);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
     }
 
-    *parse_end = pos;
-    *value = malloc(sizeof(*value));
-    (*value)->json_type = QJSON_ARRAY;
-    (*value)->v.array = array;
-
-    return SUCCESS;
+    for(uint32_t tag = 0; tag < ring->entries; tag++) {
+        if(flight[tag] != NULL) {
+            flight[tag]->data = NULL;
+            flight[tag]->error = error;
+            qjson_ingest_loaded(in, flight[tag]);
+        }
+    }
 }
 
-uint32_t qjson_load(const char *str, qjson_value_t **value, const char **parse_end) {
-    const char *pos = str;
-    while(isspace(*pos)) {
-        pos++;
+/*
+ * Each read carries a tag, the index of its file in flight; spare holds
+ * the unused tags. A file keeps its tag until it is fully read.
+ */
+static void qjson_ingest_read_uring(qjson_ingest_t *in) {
+    struct qjson_uring *ring = &in->ring;
+    struct qjson_ingest_file **flight = calloc(ring->entries, sizeof(*flight));
+    uint32_t *spare = malloc(ring->entries * sizeof(*spare));
+    uint32_t nspare = ring->entries;
+    for(uint32_t tag = 0; tag < ring->entries; tag++) {
+        spare[tag] = tag;
     }
+    size_t next = 0;
+
+    while(next < in->npaths || nspare < ring->entries) {
+        /* keep the ring full, blocking for a slot only when nothing is in flight */
+        while(next < in->npaths && nspare > 0 && qjson_ingest_slot(in, nspare == ring->entries)) {
+            struct qjson_ingest_file *f = qjson_ingest_open(in, next++);
+            if(f->error != 0 || f->size == 0) {
+                qjson_ingest_loaded(in, f);
+            } else {
+                uint32_t tag = spare[--nspare];
+                flight[tag] = f;
+                qjson_uring_read(ring, f, tag);
+            }
+        }
+        if(nspare == ring->entries) {
+            if(next < in->npaths) {
+                break;      /* stopping: no slot will be handed out */
+            }
+            continue;
+        }
+        if(qjson_uring_wait(ring) != SUCCESS) {
+            qjson_ingest_uring_abort(in, flight, ring->entries - nspare);
+            qjson_ingest_read_from(in, next);
+            break;
+        }
 
-    uint32_t ret = SUCCESS;
-    if(*pos == '-' || isdigit(*pos)) {
-        ret = qjson_load_number(pos, value, parse_end);
-    } else if(*pos == '\"') {
-        ret = qjson_load_string(pos, value, parse_end);
-    } else if(*pos == '[') {
-        ret = qjson_load_array(pos, value, parse_end);
-    } else if(*pos == '{') {
-        ret = qjson_load_object(pos, value, parse_end);
-    } else if(*pos == 't' || *pos == 'f'){
-        ret = qjson_load_bool(pos, value, parse_end);
-    } else if(*pos == 'n') {
-        ret = qjson_load_null(pos, value, parse_end);
-    } else {
-        *value = NULL;
-        *parse_end = pos;
-        return FAILURE;
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uint32_t tag = cqe->user_data;
+            struct qjson_ingest_file *f = flight[tag];
+            int res = cqe->res;
+
+            if(res == -EINVAL || res == -EOPNOTSUPP) {
+                /* kernel without IORING_OP_READ */
+                qjson_ingest_read_sync(f);
+            } else if(res == -EINTR || res == -EAGAIN) {
+                qjson_uring_read(ring, f, tag);
+                continue;
+            } else if(res < 0) {
+                f->error = -res;
+            } else if(res > 0 && (f->len += res) < f->size) {
+                qjson_uring_read(ring, f, tag);
+                continue;
+            }
+            flight[tag] = NULL;
+            spare[nspare++] = tag;
+            qjson_ingest_loaded(in, f);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
     }
-
-    return ret;
+    free(flight);
+    free(spare);
 }
+#endif
+
+static void *qjson_ingest_reader(void *arg) {
+    qjson_ingest_t *in = arg;
+#ifdef QJSON_IO_URING
+    if(in->uring) {
+        qjson_ingest_read_uring(in);
+    } else
+#endif
+    {
+        qjson_ingest_read_from(in, 0);
+    }
 
-qjson_array_t *qjson_create_array() {
-    qjson_array_t *self = malloc(sizeof(*self));
-    memset(self, 0, sizeof(sizeof(*self)));
-    return self;
+    pthread_mutex_lock(&in->lock);
+    in->reader_done = true;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
 }
 
-qjson_array_t *qjson_array_append(qjson_array_t *arr, const qjson_value_t *e) {
-    qjson_array_item_t *cur = &arr->head;
-    while(cur->next != NULL) {
-        cur = cur->next;
+/*
+ * The whole file must be one value and whitespace. The parser stops at
+ * the NUL after the data, so an embedded NUL ends it early and is
+ * reported like any other trailing byte.
+ */
+static void qjson_ingest_parse(qjson_parser_t *p, struct qjson_ingest_file *f) {
+    const char *end = f->data;
+    if(qjson_parser_load(p, f->data, &f->value, &end) == SUCCESS &&
+       (end = qjson_validate_ws(end, f->data + f->len)) != f->data + f->len) {
+        qjson_value_unref(f->value);
+        f->value = NULL;
     }
-    qjson_array_item_t *item = malloc(sizeof(*item));
-    item->value = *e;
-    item->next = NULL;
-
-    cur->next = item;
-    return arr;
+    f->error_offset = end - f->data;
 }
 
-uint32_t qjson_array_length(qjson_array_t *arr) {
-    qjson_array_item_t *cur = arr->head.next;
-    uint32_t count = 0;
+static void *qjson_ingest_worker(void *arg) {
+    qjson_ingest_t *in = arg;
+    qjson_parser_t p;
+    qjson_parser_init(&p, in->options.parser);
 
-    while(cur != NULL) {
-        cur = cur->next;
-        count++;
+    pthread_mutex_lock(&in->lock);
+    for(;;) {
+        struct qjson_ingest_file *f = NULL;
+        while(!in->stop && (f = qjson_ingest_pop(&in->loaded)) == NULL && !in->reader_done) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+        if(f == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&in->lock);
+
+        if(f->error == 0) {
+            qjson_ingest_parse(&p, f);
+            qjson_parser_reset(&p);
+        }
+        free(f->data);
+        f->data = NULL;
+
+        pthread_mutex_lock(&in->lock);
+        qjson_ingest_push(&in->parsed, f);
+        pthread_cond_broadcast(&in->cond);
     }
-    return count;
+    pthread_mutex_unlock(&in->lock);
+    qjson_parser_release(&p);
+    return NULL;
 }
 
+/*
+ * Start loading npaths files. paths (and the strings) must stay valid
+ * until qjson_ingest_destroy. NULL if no thread could be started.
+ */
+qjson_ingest_t *qjson_ingest_start(const char *const *paths, size_t npaths, const qjson_ingest_options_t *options) {
+    qjson_ingest_t *in = malloc(sizeof(*in));
+    memset(in, 0, sizeof(*in));
+    in->paths = paths;
+    in->npaths = npaths;
+    if(options != NULL) {
+        in->options = *options;
+    }
+    if(in->options.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        in->options.workers = cpus > 0? cpus: 1;
+    }
+    if(in->options.depth == 0) {
+        in->options.depth = QJSON_INGEST_DEPTH;
+    }
+    in->free_slots = in->options.depth;
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
 
-qjson_object_t *qjson_create_object() {
-    qjson_object_t *self = malloc(sizeof(*self));
-    memset(self, 0, sizeof(sizeof(*self)));
-    return self;
+#ifdef QJSON_IO_URING
+    if(!(in->options.flags & QJSON_INGEST_NO_URING)) {
+        in->uring = qjson_uring_init(&in->ring, in->options.depth) == SUCCESS;
+    }
+#endif
+
+    in->workers = malloc(in->options.workers * sizeof(*in->workers));
+    while(in->started < in->options.workers &&
+          pthread_create(&in->workers[in->started], NULL, qjson_ingest_worker, in) == 0) {
+        in->started++;
+    }
+    if(in->started == 0 || pthread_create(&in->reader, NULL, qjson_ingest_reader, in) != 0) {
+        pthread_mutex_lock(&in->lock);
+        in->reader_done = true;
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+        for(uint32_t i = 0; i < in->started; i++) {
+            pthread_join(in->workers[i], NULL);
+        }
+#ifdef QJSON_IO_URING
+        if(in->uring) {
+            qjson_uring_release(&in->ring);
+        }
+#endif
+        pthread_cond_destroy(&in->cond);
+        pthread_mutex_destroy(&in->lock);
+        free(in->workers);
+        free(in);
+        return NULL;
+    }
+    return in;
 }
 
+/* true when the files are read through io_uring */
+bool qjson_ingest_uring(const qjson_ingest_t *in) {
+    return in->uring;
+}
 
-qjson_object_t *qjson_object_append(qjson_object_t *obj, const char *key, const qjson_value_t *e) {
-    qjson_pair_t *pair = malloc(sizeof(qjson_pair_t));
-    pair->key = strdup(key);
-    pair->value = *e; //TODO: deep copy
-    pair->next = NULL;
+/*
+ * Wait for the next finished file. FAILURE once every path has been
+ * delivered (or the reader gave up on the rest). Taking a result frees
+ * its slot for the reader.
+ */
+uint32_t qjson_ingest_next(qjson_ingest_t *in, qjson_ingest_result_t *result) {
+    pthread_mutex_lock(&in->lock);
+    struct qjson_ingest_file *f = NULL;
+    while(in->delivered < in->npaths && (f = qjson_ingest_pop(&in->parsed)) == NULL &&
+          !(in->reader_done && in->delivered == in->produced)) {
+        pthread_cond_wait(&in->cond, &in->lock);
+    }
+    if(f == NULL) {
+        pthread_mutex_unlock(&in->lock);
+        return FAILURE;
+    }
+    in->delivered++;
+    in->free_slots++;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+
+    result->index = f->index;
+    result->path = in->paths[f->index];
+    result->value = f->value;
+    result->error = f->error;
+    result->error_offset = f->error_offset;
+    free(f);
+    return SUCCESS;
+}
 
-    qjson_pair_t *last = &obj->head;
-    while(last->next != NULL){
-        last = last->next;
+/* stop early if need be, wait for the threads and drop undelivered results */
+void qjson_ingest_destroy(qjson_ingest_t *in) {
+    if(in == NULL) {
+        return;
     }
-    last->next = pair;
+    pthread_mutex_lock(&in->lock);
+    in->stop = true;
+    pthread_cond_broadcast(&in->cond);
+    pthread_mutex_unlock(&in->lock);
+
+    pthread_join(in->reader, NULL);
+    for(uint32_t i = 0; i < in->started; i++) {
+        pthread_join(in->workers[i], NULL);
+    }
+#ifdef QJSON_IO_URING
+    if(in->uring) {
+        qjson_uring_release(&in->ring);
+    }
+#endif
 
-    return obj;
+    struct qjson_ingest_file *f;
+    while((f = qjson_ingest_pop(&in->loaded)) != NULL) {
+        qjson_ingest_file_free(f);
+    }
+    while((f = qjson_ingest_pop(&in->parsed)) != NULL) {
+        qjson_ingest_file_free(f);
+    }
+    pthread_cond_destroy(&in->cond);
+    pthread_mutex_destroy(&in->lock);
+    free(in->workers);
+    free(in);
 }
 
+
 void test_dump_str_array() {
     const char * strlist[] = {
         "linux",
@@ -764,14 +4629,14 @@ void test_dump_str_array() {
 
     while(*p != NULL) {
         qjson_value_t *value = qjson_create_str(*p++);
-        qjson_array_append(arr, value);
+        arr = qjson_array_append_new(arr, value);
     }
 
     qjson_value_t *value = qjson_create_int(12345);
-    qjson_array_append(arr, value);
+    arr = qjson_array_append_new(arr, value);
 
     value = qjson_create_float(12345.6789);
-    qjson_array_append(arr, value);
+    arr = qjson_array_append_new(arr, value);
 
     char buf[BUFLEN];
     int bytes = qjson_dump_array(arr, buf, BUFLEN);
@@ -804,11 +4669,11 @@ void test_dump_object() {
 
     qjson_object_t *object = qjson_create_object();
     for(int i=0; i<elemsof(datas1); i++) {
-        qjson_object_append(object, datas1[i].key, qjson_create_str(datas1[i].value));
+        object = qjson_object_append_new(object, datas1[i].key, qjson_create_str(datas1[i].value));
     }
 
     for(int i=0; i<elemsof(datas2); i++) {
-        qjson_object_append(object, datas2[i].key, qjson_create_int(datas2[i].value));
+        object = qjson_object_append_new(object, datas2[i].key, qjson_create_int(datas2[i].value));
     }
 
 
@@ -860,18 +4725,18 @@ void test_dump_number_array() {
         qjson_value_t *number;
         char *end;
         qjson_load_number(*cur++, &number, (const char**)&end);
-        qjson_array_append(arr, number);
+        arr = qjson_array_append_new(arr, number);
     }
 
     qjson_value_t *temp;
     temp = qjson_create_bool(true);
-    qjson_array_append(arr, temp);
+    arr = qjson_array_append_new(arr, temp);
 
     temp = qjson_create_bool(false);
-    qjson_array_append(arr, temp);
+    arr = qjson_array_append_new(arr, temp);
 
     temp = qjson_create_null();
-    qjson_array_append(arr, temp);
+    arr = qjson_array_append_new(arr, temp);
 
     char buf[BUFLEN];
     int bytes = qjson_dump_array(arr, buf, BUFLEN);
@@ -952,6 +4817,804 @@ void test_load_fraction() {
     printf("parse_end = %s\n", end);
 }
 
+void test_parser_reuse() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *docs[] = {
+        "{\"id\": 1, \"tags\": [\"a\", \"b\"]}",
+        "[true, false, null, -1.5, \"x\\ty\"]",
+        "{\"nested\": {\"deeper\": {\"deepest\": []}}}",
+        "{\"broken\": [1, 2}",
+        NULL,
+    };
+
+    qjson_parser_t *p = qjson_parser_create(NULL);
+    char buf[BUFLEN];
+
+    for(const char **doc = docs; *doc != NULL; doc++) {
+        qjson_value_t *value;
+        const char *end;
+        uint32_t ret = qjson_parser_load(p, *doc, &value, &end);
+        if(ret == SUCCESS) {
+            qjson_dump(value, buf, BUFLEN);
+            printf("ok: %s\n", buf);
+        } else {
+            printf("failed at offset %ld: %s\n", end - *doc, *doc);
+        }
+        qjson_value_unref(value);
+        qjson_parser_reset(p);
+    }
+
+    /* keys are no longer limited to BUFLEN */
+    uint32_t keylen = 3 * BUFLEN;
+    char *doc = malloc(keylen + 16);
+    doc[0] = '{';
+    doc[1] = '\"';
+    memset(doc + 2, 'k', keylen);
+    strcpy(doc + 2 + keylen, "\": 1}");
+
+    qjson_value_t *value;
+    const char *end;
+    qjson_parser_load(p, doc, &value, &end);
+    printf("long key length: %u (expected %u)\n", value->v.object->head.next->keylen, keylen);
+    qjson_value_unref(value);
+    free(doc);
+    qjson_parser_destroy(p);
+
+    qjson_parser_options_t options = {.max_depth = 4};
+    p = qjson_parser_create(&options);
+    uint32_t ret = qjson_parser_load(p, "[[[[1]]]]", &value, &end);
+    printf("depth 4: ret = %u\n", ret);
+    qjson_value_unref(value);
+    ret = qjson_parser_load(p, "[[[[[1]]]]]", &value, &end);
+    printf("depth 5: ret = %u, parse_end = %s\n", ret, end);
+    qjson_parser_destroy(p);
+}
+
+void test_short_strings() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *strs[] = {"", "CN", "order-4711", "fifteen-chars!!", "sixteen-chars!!!", NULL};
+    for(const char **str = strs; *str != NULL; str++) {
+        qjson_value_t *value = qjson_create_str(*str);
+        bool inline_str = qjson_value_str(value) == value->v.str.sso;
+        printf("[%s] len %u, %s\n", qjson_value_str(value), value->len, inline_str? "inline": "heap");
+        qjson_value_unref(value);
+    }
+    printf("sizeof(qjson_value_t) = %lu\n", sizeof(qjson_value_t));
+}
+
+void test_shared_subtrees() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    qjson_value_t *fragment;
+    const char *end;
+    qjson_load("{\"currency\": \"EUR\", \"rates\": [1.1, 0.9]}", &fragment, &end);
+
+    /* both responses embed the cached fragment without copying it */
+    qjson_object_t *resp1 = qjson_create_object();
+    qjson_object_t *resp2 = qjson_create_object();
+    resp1 = qjson_object_set_new(resp1, "id", qjson_create_int(1));
+    resp1 = qjson_object_set(resp1, "pricing", fragment);
+    resp2 = qjson_object_set_new(resp2, "id", qjson_create_int(2));
+    resp2 = qjson_object_set(resp2, "pricing", fragment);
+    printf("fragment refcount: %u\n", fragment->v.object->node.refcount);
+
+    /* modifying a shared subtree copies it, the other sharers are unaffected */
+    qjson_value_t *pricing = qjson_value_ref(qjson_object_get(resp2, "pricing"));
+    pricing->v.object = qjson_object_set_new(pricing->v.object, "currency", qjson_create_str("USD"));
+    resp2 = qjson_object_set_new(resp2, "pricing", pricing);
+    printf("fragment refcount after copy-on-write: %u\n", fragment->v.object->node.refcount);
+
+    char buf[BUFLEN];
+    qjson_dump_object(resp1, buf, BUFLEN);
+    printf("resp1: %s\n", buf);
+    qjson_dump_object(resp2, buf, BUFLEN);
+    printf("resp2: %s\n", buf);
+
+    qjson_object_unref(resp1);
+    qjson_object_unref(resp2);
+    qjson_value_unref(fragment);
+}
+
+static int test_count_sink(void *userdata, const char *data, size_t len) {
+    *(size_t *)userdata += len;
+    return 0;
+}
+
+void test_dump_parallel() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    /* {"results": [{"id": 0, "name": "row", "score": 0.5}, ...], "total": n} */
+    uint32_t rows = 20000;
+    qjson_array_t *results = qjson_create_array();
+    for(uint32_t i = 0; i < rows; i++) {
+        qjson_object_t *row = qjson_create_object();
+        row = qjson_object_append_new(row, "id", qjson_create_int(i));
+        row = qjson_object_append_new(row, "name", qjson_create_str(i % 2? "row with a longer \"name\"": "row"));
+        row = qjson_object_append_new(row, "score", qjson_create_float(i * 0.5));
+        qjson_value_t value = {.json_type = QJSON_OBJECT, .v.object = row};
+        results = qjson_array_append(results, &value);
+        qjson_object_unref(row);
+    }
+    qjson_value_t results_value = {.json_type = QJSON_ARRAY, .v.array = results};
+    qjson_object_t *doc = qjson_create_object();
+    doc = qjson_object_append(doc, "results", &results_value);
+    doc = qjson_object_append_new(doc, "total", qjson_create_int(rows));
+    qjson_array_unref(results);
+    qjson_value_t value = {.json_type = QJSON_OBJECT, .v.object = doc};
+
+    size_t seq_len, par_len;
+    char *seq = qjson_dump_alloc(&value, 0, &seq_len);
+
+    uint32_t threads[] = {1, 2, 4, 7};
+    for(int i = 0; i < elemsof(threads); i++) {
+        qjson_dump_options_t options = {.threads = threads[i], .chunk_size = 100};
+        char *par = qjson_dump_parallel_alloc(&value, &options, &par_len);
+        printf("threads %u: %lu bytes, %s\n", threads[i], par_len,
+               par_len == seq_len && memcmp(seq, par, seq_len) == 0? "identical": "DIFFERENT");
+        free(par);
+    }
+
+    size_t streamed = 0;
+    qjson_dump_parallel(&value, NULL, test_count_sink, &streamed);
+    printf("streamed %lu bytes to sink\n", streamed);
+
+    free(seq);
+    qjson_object_unref(doc);
+
+    /* a small envelope around one large array: the array is still shared out */
+    uint32_t items = 100000;
+    char *text = malloc(items * 16 + 128);
+    size_t len = sprintf(text, "{\"status\": \"ok\", \"meta\": {\"version\": 2}, \"page\": 1, \"count\": %u, \"data\": [", items);
+    for(uint32_t i = 0; i < items; i++) {
+        len += sprintf(text + len, "%s{\"id\": %u}", i > 0? ", ": "", i);
+    }
+    strcpy(text + len, "]}");
+    qjson_value_t *envelope;
+    const char *end;
+    qjson_load(text, &envelope, &end);
+    free(text);
+    seq = qjson_dump_alloc(envelope, 0, &seq_len);
+    for(uint32_t t = 2; t <= 4; t += 2) {
+        qjson_dump_options_t options = {.threads = t};
+        struct qjson_dump_pool pool;
+        qjson_dump_pool_plan(&pool, envelope, &options);
+        size_t jobs = 0;
+        for(size_t i = 0; i < pool.njobs; i++) {
+            jobs += pool.jobs[i].kind != QJSON_DUMP_TEXT;
+            qjson_buf_release(&pool.jobs[i].out);
+        }
+        free(pool.jobs);
+        char *par = qjson_dump_parallel_alloc(envelope, &options, &par_len);
+        printf("envelope, threads %u: %s, %s\n", t, jobs >= 2 * t? "more than one job per thread": "TOO FEW JOBS",
+               par_len == seq_len && memcmp(seq, par, seq_len) == 0? "identical": "DIFFERENT");
+        free(par);
+    }
+    free(seq);
+    qjson_value_unref(envelope);
+}
+
+void test_incremental_dump() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *doc = "{\"service\": {\"name\": \"catalog\", \"regions\": [\"eu-west\", \"us-east\", \"ap-south\"]},"
+                      " \"stats\": {\"requests\": 0, \"errors\": 0, \"latency\": {\"p50\": 1.5, \"p99\": 12.25}},"
+                      " \"items\": [{\"sku\": \"A-1\", \"price\": 10}, {\"sku\": \"B-2\", \"price\": 20}]}";
+    qjson_value_t *cached, *plain;
+    const char *end;
+    qjson_load(doc, &cached, &end);
+    qjson_load(doc, &plain, &end);
+    qjson_cache_enable(cached);
+
+    qjson_value_t *docs[] = {cached, plain};
+    for(int round = 1; round <= 3; round++) {
+        for(int i = 0; i < elemsof(docs); i++) {
+            qjson_value_t *stats = qjson_value_get_mut(docs[i], "stats");
+            stats->v.object = qjson_object_set_new(stats->v.object, "requests", qjson_create_int(round * 100));
+            qjson_value_t *item = qjson_value_at_mut(qjson_value_get_mut(docs[i], "items"), 1);
+            item->v.object = qjson_object_set_new(item->v.object, "price", qjson_create_int(20 + round));
+        }
+
+        /* only the modified path is dirty */
+        bool service_clean = qjson_object_get(cached->v.object, "service")->v.object->node.cache != NULL;
+        bool stats_clean = qjson_object_get(cached->v.object, "stats")->v.object->node.cache != NULL;
+
+        size_t cached_len, plain_len;
+        char *a = qjson_dump_alloc(cached, 0, &cached_len);
+        char *b = qjson_dump_alloc(plain, 0, &plain_len);
+        printf("round %d: service %s, stats %s, output %s\n", round,
+               service_clean? "clean": "dirty", stats_clean? "clean": "dirty",
+               cached_len == plain_len && memcmp(a, b, plain_len) == 0? "identical": "DIFFERENT");
+        free(a);
+        free(b);
+    }
+
+    /* copying a shared member for another holder leaves the parent's bytes alone */
+    qjson_value_t *held = qjson_value_ref(qjson_object_get(cached->v.object, "service"));
+    qjson_value_get_mut(held, "name");
+    printf("copy on write elsewhere: root %s, member %s\n", cached->v.object->node.cache != NULL? "clean": "dirty",
+           held->v.object == qjson_object_get(cached->v.object, "service")->v.object? "SHARED": "copied");
+    qjson_value_unref(held);
+
+    /* each set of dump flags keeps its own bytes */
+    size_t ascii_len, plain_len;
+    char *a = qjson_dump_alloc(cached, QJSON_DUMP_ASCII, &ascii_len);
+    char *b = qjson_dump_alloc(plain, QJSON_DUMP_ASCII, &plain_len);
+    struct qjson_node *root = &cached->v.object->node;
+    printf("ascii: %s, cached for plain %s, for ascii %s\n",
+           ascii_len == plain_len && memcmp(a, b, plain_len) == 0? "identical": "DIFFERENT",
+           qjson_node_cached(root, 0) != NULL? "yes": "no", qjson_node_cached(root, QJSON_DUMP_ASCII) != NULL? "yes": "no");
+    free(a);
+    free(b);
+
+    char buf[BUFLEN];
+    qjson_dump(cached, buf, BUFLEN);
+    printf("dump: %s\n", buf);
+    qjson_value_unref(cached);
+    qjson_value_unref(plain);
+}
+
+void test_validate() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *docs[] = {
+        "{\"a\": [1, -0.5e+3, true, false, null, \"x\\u00e9\\n\"], \"b\": {}}",
+        "  [\"caf\xc3\xa9\", \"\xf0\x9f\x98\x80\"]  ",
+        "0",
+        "[1,]",
+        "{\"a\" 1}",
+        "[01]",
+        "[1.]",
+        "[-]",
+        "\"\\x\"",
+        "\"tab\there\"",
+        "\"\xc3\x28\"",
+        "\"\xed\xa0\x80\"",
+        "\"\xe2\x82\"",
+        "[1] 2",
+        "[[[",
+        NULL,
+    };
+    for(const char **doc = docs; *doc != NULL; doc++) {
+        printf("%s: %s\n", qjson_validate(*doc, strlen(*doc)) == SUCCESS? "valid  ": "invalid", *doc);
+    }
+
+    /* not NUL terminated: only the first len bytes count */
+    printf("prefix: %s\n", qjson_validate("[1, 2]garbage", 6) == SUCCESS? "valid": "invalid");
+
+    /* a long string ending in a run of backslashes, then a quote: escaped when the run is odd */
+    char doc[160];
+    size_t len;
+    printf("backslash runs:");
+    for(int run = 1; run <= 4; run++) {
+        len = 0;
+        memcpy(doc, "[\"", 2);
+        len += 2;
+        memset(doc + len, 'a', 62 - run);
+        len += 62 - run;
+        memset(doc + len, '\\', run);
+        len += run;
+        memcpy(doc + len, "\"]", 2);
+        len += 2;
+        printf(" %d %s", run, qjson_validate(doc, len) == SUCCESS? "valid": "invalid");
+    }
+    printf("\n");
+
+    /* numbers and literals cut in the middle */
+    len = 0;
+    doc[len++] = '[';
+    for(int i = 0; i < 16; i++) {
+        len += snprintf(doc + len, sizeof(doc) - len, "%s1234567", i > 0? ",": "");
+    }
+    doc[len++] = ']';
+    printf("numbers: %s, cut at 64: %s\n", qjson_validate(doc, len) == SUCCESS? "valid": "invalid",
+           qjson_validate(doc, 64) == SUCCESS? "valid": "invalid");
+    memset(doc, ' ', 62);
+    memcpy(doc + 62, "true", 4);
+    printf("literal: %s, cut at 65: %s\n", qjson_validate(doc, 66) == SUCCESS? "valid": "invalid",
+           qjson_validate(doc, 65) == SUCCESS? "valid": "invalid");
+}
+
+void test_unicode_escapes() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *docs[] = {
+        "\"caf\\u00e9 \\u0041\\/\"",
+        "\"\\ud83d\\ude00\"",
+        "\"lone \\udc00\"",
+        "\"\\q\"",
+        "\"\\u12g4\"",
+        NULL,
+    };
+    for(const char **doc = docs; *doc != NULL; doc++) {
+        qjson_value_t *value = NULL;
+        const char *end = NULL;
+        if(qjson_load(*doc, &value, &end) != SUCCESS) {
+            printf("%s: rejected at %ld\n", *doc, (long)(end - *doc));
+            continue;
+        }
+        printf("%s: %s (%u bytes)\n", *doc, qjson_value_str(value), value->len);
+        qjson_value_unref(value);
+    }
+
+    qjson_value_t *value = qjson_create_strn("caf\xc3\xa9 \xf0\x9f\x98\x80 \x01\x1f\n \xff", 16);
+    char buf[128];
+    qjson_dump_ex(value, buf, sizeof(buf), 0);
+    printf("utf-8: %s\n", buf);
+    qjson_dump_ex(value, buf, sizeof(buf), QJSON_DUMP_ASCII);
+    printf("ascii: %s\n", buf);
+
+    /* what ASCII mode writes loads back to the same bytes */
+    qjson_value_t *ascii = NULL;
+    qjson_value_t *utf8 = qjson_create_str("\xe6\x97\xa5\xe6\x9c\xac \xf0\x9f\x98\x80 plain text long enough to take the vector path");
+    char *text = qjson_dump_alloc(utf8, QJSON_DUMP_ASCII, NULL);
+    qjson_load(text, &ascii, NULL);
+    printf("round trip: %s\n", ascii != NULL && ascii->len == utf8->len &&
+           memcmp(qjson_value_str(ascii), qjson_value_str(utf8), utf8->len) == 0? "same": "differs");
+    free(text);
+    qjson_value_unref(ascii);
+    qjson_value_unref(utf8);
+    qjson_value_unref(value);
+}
+
+void test_lazy_numbers() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *doc = "{\"id\": 12345678901234567890123, \"pi\": 3.14159265358979323846, \"n\": -42, \"e\": 1e400}";
+    char buf[BUFLEN];
+    qjson_value_t *value;
+    const char *end;
+
+    /* eager: only the integer that overflows int64 stays as text */
+    qjson_load(doc, &value, &end);
+    qjson_dump(value, buf, BUFLEN);
+    printf("eager: %s\n", buf);
+    qjson_value_unref(value);
+
+    qjson_parser_options_t options = {.flags = QJSON_PARSE_LAZY_NUMBERS};
+    qjson_parser_t *p = qjson_parser_create(&options);
+    qjson_parser_load(p, doc, &value, &end);
+    qjson_dump(value, buf, BUFLEN);
+    printf("lazy:  %s\n", buf);
+
+    const char *keys[] = {"id", "pi", "n", "e"};
+    for(int i = 0; i < elemsof(keys); i++) {
+        const qjson_value_t *number = qjson_object_get(value->v.object, keys[i]);
+        int64_t integer;
+        double fraction;
+        uint32_t len;
+        const char *text = qjson_value_number_text(number, &len);
+        printf("%s: text %.*s, ", keys[i], (int)len, text);
+        if(qjson_value_int64(number, &integer) == SUCCESS) {
+            printf("int64 %lld, ", (long long)integer);
+        } else {
+            printf("not an int64, ");
+        }
+        qjson_value_double(number, &fraction);
+        printf("double %g\n", fraction);
+    }
+    qjson_value_unref(value);
+    qjson_parser_destroy(p);
+
+    /* borrowed: long text stays in doc, converted on the first read only */
+    options.flags = QJSON_PARSE_LAZY_NUMBERS | QJSON_PARSE_BORROW_INPUT;
+    p = qjson_parser_create(&options);
+    qjson_parser_load(p, doc, &value, &end);
+    const qjson_value_t *pi = qjson_object_get(value->v.object, "pi");
+    const char *text = qjson_value_number_text(pi, NULL);
+    double first, second;
+    bool cached_before = pi->len & QJSON_NUMBER_CACHED;
+    qjson_value_double(pi, &first);
+    qjson_value_double(pi, &second);
+    printf("borrowed: text in input %s, cached before read %s, after %s, reads agree %s\n",
+           text >= doc && text < doc + strlen(doc)? "yes": "no", cached_before? "yes": "no",
+           pi->len & QJSON_NUMBER_CACHED? "yes": "no", first == second? "yes": "no");
+
+    qjson_value_t *copy = qjson_value_ref(pi);
+    qjson_value_double(copy, &second);
+    printf("copy: text shared %s, cache kept %s, double %.17g\n",
+           qjson_value_number_text(copy, NULL) == text? "yes": "no",
+           copy->len & QJSON_NUMBER_CACHED? "yes": "no", second);
+    qjson_value_unref(copy);
+    qjson_compact(value);
+    qjson_dump(value, buf, BUFLEN);
+    printf("compacted: %s\n", buf);
+    qjson_value_unref(value);
+    qjson_parser_destroy(p);
+
+    qjson_value_t *big = qjson_create_number("-9223372036854775809", 20);
+    int64_t integer;
+    printf("INT64_MIN - 1: %s, not a number: %s\n", qjson_value_int64(big, &integer) == SUCCESS? "fits": "overflows",
+           qjson_create_number("01", 2) == NULL? "rejected": "accepted");
+    qjson_value_unref(big);
+}
+
+void test_writer() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    qjson_writer_t w;
+    qjson_writer_init(&w, 0, NULL, NULL);
+    qjson_writer_begin_object(&w);
+    qjson_writer_key(&w, "id");
+    qjson_writer_number(&w, "12345678901234567890", 20);
+    qjson_writer_key(&w, "name");
+    qjson_writer_string(&w, "say \"hi\"\n");
+    qjson_writer_key(&w, "tags");
+    qjson_writer_begin_array(&w);
+    qjson_writer_int(&w, -1);
+    qjson_writer_double(&w, 0.5);
+    qjson_writer_bool(&w, true);
+    qjson_writer_null(&w);
+    qjson_writer_begin_object(&w);
+    qjson_writer_end_object(&w);
+    qjson_writer_end_array(&w);
+    qjson_writer_end_object(&w);
+    printf("finish: %s\n", qjson_writer_finish(&w) == SUCCESS? "ok": "failed");
+    printf("%s\n", qjson_writer_output(&w, NULL));
+
+    /* the same output as dumping the tree it describes */
+    qjson_value_t *value;
+    const char *end;
+    char buf[BUFLEN];
+    qjson_load(qjson_writer_output(&w, NULL), &value, &end);
+    qjson_dump(value, buf, BUFLEN);
+    printf("matches qjson_dump: %s\n", strcmp(buf, qjson_writer_output(&w, NULL)) == 0? "yes": "no");
+    qjson_value_unref(value);
+
+    /* misuse: a value where a key belongs, an unbalanced end */
+    qjson_writer_reset(&w);
+    qjson_writer_begin_object(&w);
+    printf("value without key: %s\n", qjson_writer_int(&w, 1) == SUCCESS? "accepted": "rejected");
+    qjson_writer_reset(&w);
+    qjson_writer_begin_array(&w);
+    printf("end_object in array: %s\n", qjson_writer_end_object(&w) == SUCCESS? "accepted": "rejected");
+    qjson_writer_reset(&w);
+    qjson_writer_begin_array(&w);
+    printf("unclosed array: %s\n", qjson_writer_finish(&w) == SUCCESS? "accepted": "rejected");
+    qjson_writer_release(&w);
+
+    /* with a sink the buffer stays around QJSON_WRITER_FLUSH bytes */
+    size_t streamed = 0;
+    qjson_writer_init(&w, 0, test_count_sink, &streamed);
+    qjson_writer_begin_array(&w);
+    for(int i = 0; i < 100000; i++) {
+        qjson_writer_int(&w, i);
+    }
+    qjson_writer_end_array(&w);
+    qjson_writer_finish(&w);
+    printf("streamed %zu bytes through a %zu byte buffer\n", streamed, w.buf.cap);
+    qjson_writer_release(&w);
+}
+
+void test_packed_arrays() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    const char *docs[] = {
+        "[1, 2, 3, -4]",
+        "[0.5, 1e2, -2.25]",
+        "[1, 2.5]",
+        "[1, 2, \"three\"]",
+        "[1, [2, 3], [4.5], []]",
+        "{\"x\": [7, 8], \"y\": [1, 99999999999999999999]}",
+        "[1, 2, }",
+        NULL,
+    };
+    const char *types[] = {[QJSON_INVALID] = "list", [QJSON_INT] = "int64", [QJSON_FLOAT] = "double"};
+    char buf[BUFLEN];
+    qjson_parser_options_t pack = {.flags = QJSON_PARSE_PACK_ARRAYS};
+    qjson_parser_t p;
+    qjson_parser_init(&p, &pack);
+
+    for(const char **doc = docs; *doc != NULL; doc++) {
+        qjson_value_t *value;
+        const char *end;
+        qjson_parser_reset(&p);
+        if(qjson_parser_load(&p, *doc, &value, &end) != SUCCESS) {
+            printf("failed at offset %ld: %s\n", end - *doc, *doc);
+            continue;
+        }
+        qjson_dump(value, buf, BUFLEN);
+        if(value->json_type == QJSON_ARRAY) {
+            printf("%-6s %s\n", types[qjson_array_packed_type(value->v.array)], buf);
+        } else {
+            printf("x: %s, y: %s, %s\n", types[qjson_array_packed_type(qjson_object_get(value->v.object, "x")->v.array)],
+                   types[qjson_array_packed_type(qjson_object_get(value->v.object, "y")->v.array)], buf);
+        }
+        qjson_value_unref(value);
+    }
+
+    /* without the flag the same array stays an item list */
+    qjson_value_t *list;
+    qjson_load(docs[0], &list, NULL);
+    uint32_t walked = 0;
+    for(qjson_array_item_t *item = list->v.array->head.next; item != NULL; item = item->next) {
+        walked++;
+    }
+    printf("default: %s, %u items walked, length %u\n", types[qjson_array_packed_type(list->v.array)], walked,
+           qjson_array_length(list->v.array));
+
+    /* packing on request; an array of mixed kinds is left alone */
+    list->v.array = qjson_array_pack(list->v.array);
+    qjson_value_t *three = qjson_create_int(3);
+    qjson_value_t *half = qjson_create_float(0.5);
+    qjson_array_t *mixed = qjson_array_append(qjson_array_append(qjson_create_array(), three), half);
+    mixed = qjson_array_pack(mixed);
+    qjson_dump(list, buf, BUFLEN);
+    printf("packed: %s %s, mixed: %s\n", types[qjson_array_packed_type(list->v.array)], buf,
+           types[qjson_array_packed_type(mixed)]);
+    qjson_array_unref(mixed);
+    qjson_value_unref(three);
+    qjson_value_unref(half);
+    qjson_value_unref(list);
+
+    /* a large column: summed straight from the typed accessor */
+    uint32_t n = 100000;
+    qjson_writer_t w;
+    qjson_writer_init(&w, 0, NULL, NULL);
+    qjson_writer_begin_array(&w);
+    for(uint32_t i = 0; i < n; i++) {
+        qjson_writer_int(&w, i);
+    }
+    qjson_writer_end_array(&w);
+    qjson_writer_finish(&w);
+
+    qjson_value_t *value;
+    qjson_parser_reset(&p);
+    qjson_parser_load(&p, qjson_writer_output(&w, NULL), &value, NULL);
+    qjson_parser_release(&p);
+    size_t count;
+    const int64_t *ints = qjson_array_ints(value->v.array, &count);
+    int64_t sum = 0;
+    for(size_t i = 0; i < count; i++) {
+        sum += ints[i];
+    }
+    printf("%zu ints, sum %lld (expected %lld)\n", count, (long long)sum, (long long)n * (n - 1) / 2);
+
+    size_t len, parallel_len;
+    char *text = qjson_dump_alloc(value, 0, &len);
+    qjson_dump_options_t options = {.threads = 4, .chunk_size = 1000};
+    char *parallel = qjson_dump_parallel_alloc(value, &options, &parallel_len);
+    printf("round trip: %s, parallel: %s\n", strcmp(text, qjson_writer_output(&w, NULL)) == 0? "same": "differs",
+           parallel_len == len && memcmp(parallel, text, len) == 0? "same": "differs");
+    free(text);
+    free(parallel);
+    qjson_writer_release(&w);
+
+    /* storing something else unpacks it, a shared copy keeps its column */
+    qjson_array_t *shared = value->v.array;
+    qjson_node_ref(&shared->node);
+    qjson_value_t *slot = qjson_value_at_mut(value, 1);
+    qjson_value_clear(slot);
+    *slot = (qjson_value_t){.json_type = QJSON_NULL};
+    printf("after set: %s, shared copy: %s, lengths %u %u\n", types[qjson_array_packed_type(value->v.array)],
+           types[qjson_array_packed_type(shared)], qjson_array_length(value->v.array), qjson_array_length(shared));
+    qjson_array_unref(shared);
+    qjson_value_unref(value);
+}
+
+struct test_point {
+    int64_t x;
+    int32_t y;
+    double weight;
+};
+
+struct test_order {
+    int64_t id;
+    char *customer;
+    bool paid;
+    struct test_point at;
+};
+
+void test_schema() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    static const qjson_field_t point_fields[] = {
+        QJSON_FIELD(struct test_point, x, QJSON_FIELD_INT64),
+        QJSON_FIELD(struct test_point, y, QJSON_FIELD_INT32),
+        QJSON_FIELD(struct test_point, weight, QJSON_FIELD_DOUBLE),
+    };
+    qjson_schema_t *point = qjson_schema_compile(point_fields, elemsof(point_fields));
+    const qjson_field_t order_fields[] = {
+        QJSON_FIELD(struct test_order, id, QJSON_FIELD_INT64),
+        QJSON_FIELD(struct test_order, customer, QJSON_FIELD_STRING),
+        QJSON_FIELD(struct test_order, paid, QJSON_FIELD_BOOL),
+        QJSON_FIELD_STRUCT(struct test_order, at, point),
+    };
+    qjson_schema_t *order = qjson_schema_compile(order_fields, elemsof(order_fields));
+
+    const char *docs[] = {
+        "{\"id\": 42, \"customer\": \"J\\u00f6rg \\\"JJ\\\"\", \"extra\": {\"deep\": [1, {\"x\": 2}]}, \"paid\": true,"
+        " \"at\": {\"weight\": 0.25, \"y\": -7, \"x\": 9007199254740993}}",
+        "{\"id\": 7, \"\\u0070aid\": false, \"customer\": null}",
+        "{\"id\": 1.5}",
+        "{\"at\": {\"y\": 3000000000}}",
+        "{\"id\": 1, \"unknown\": [1, 2}",
+        NULL,
+    };
+    qjson_parser_t *p = qjson_parser_create(NULL);
+    qjson_writer_t w;
+    qjson_writer_init(&w, 0, NULL, NULL);
+    for(const char **doc = docs; *doc != NULL; doc++) {
+        struct test_order o;
+        memset(&o, 0, sizeof(o));
+        const char *end;
+        if(qjson_schema_load(p, order, *doc, strlen(*doc), &o, &end) != SUCCESS) {
+            printf("failed at offset %ld\n", end - *doc);
+        } else {
+            qjson_writer_reset(&w);
+            qjson_schema_dump(order, &o, &w);
+            printf("%s\n", qjson_writer_output(&w, NULL));
+        }
+        qjson_schema_free(order, &o);
+    }
+    qjson_writer_release(&w);
+    qjson_parser_destroy(p);
+
+    static const qjson_field_t twice[] = {
+        QJSON_FIELD(struct test_point, x, QJSON_FIELD_INT64),
+        {"x", offsetof(struct test_point, y), QJSON_FIELD_INT32, NULL},
+    };
+    printf("duplicate name: %s\n", qjson_schema_compile(twice, elemsof(twice)) == NULL? "rejected": "accepted");
+    qjson_schema_destroy(order);
+    qjson_schema_destroy(point);
+}
+
+void test_ingest() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    char dir[] = "/tmp/qjson_ingest_XXXXXX";
+    if(mkdtemp(dir) == NULL) {
+        printf("mkdtemp failed\n");
+        return;
+    }
+
+    /*
+     * files 0..n-1 hold {"id": i, "values": [...]}; one is broken, one is
+     * missing, one has bytes after the value and one a NUL inside it
+     */
+    enum { n = 200, broken = 17, missing = 42, trailing = 63, nul = 99 };
+    char *paths[n];
+    for(int i = 0; i < n; i++) {
+        paths[i] = malloc(sizeof(dir) + 32);
+        sprintf(paths[i], "%s/%d.json", dir, i);
+        if(i == missing) {
+            continue;
+        }
+        FILE *fp = fopen(paths[i], "w");
+        if(i == broken) {
+            fprintf(fp, "{\"id\": %d, \"values\": [1, 2", i);
+        } else if(i == trailing) {
+            fprintf(fp, "{\"id\": %d} trailing garbage", i);
+        } else if(i == nul) {
+            fwrite("{\"id\": 99}\n\0{}", 1, 15, fp);
+        } else {
+            fprintf(fp, "{\"id\": %d, \"values\": [", i);
+            for(int k = 0; k < i * 10; k++) {
+                fprintf(fp, "%s%d", k > 0? ", ": "", k);
+            }
+            fprintf(fp, "]}\n");
+        }
+        fclose(fp);
+    }
+
+    for(int mode = 0; mode < 2; mode++) {
+        qjson_ingest_options_t options = {.workers = 3, .depth = 8, .flags = mode == 0? 0: QJSON_INGEST_NO_URING};
+        qjson_ingest_t *in = qjson_ingest_start((const char *const *)paths, n, &options);
+        qjson_ingest_result_t result;
+        int ok = 0;
+        int64_t ids = 0;
+        while(qjson_ingest_next(in, &result) == SUCCESS) {
+            if(result.value != NULL) {
+                const qjson_value_t *field = qjson_object_get(result.value->v.object, "id");
+                int64_t id = -1;
+                if(field != NULL) {
+                    qjson_value_int64(field, &id);
+                }
+                ok += id == result.index;
+                ids += id;
+                qjson_value_unref(result.value);
+            } else if(result.error != 0) {
+                printf("%s: file %zu unreadable (%s)\n", mode == 0? "default": "read()", result.index,
+                       result.error == ENOENT? "ENOENT": "other");
+            } else {
+                printf("%s: file %zu bad at offset %zu\n", mode == 0? "default": "read()", result.index, result.error_offset);
+            }
+        }
+        printf("%s: %d parsed, id sum %lld\n", mode == 0? "default": "read()", ok, (long long)ids);
+        qjson_ingest_destroy(in);
+    }
+
+    /* stopping with files still in the pipeline */
+    qjson_ingest_options_t options = {.workers = 2, .depth = 4};
+    qjson_ingest_t *in = qjson_ingest_start((const char *const *)paths, n, &options);
+    qjson_ingest_result_t result;
+    qjson_ingest_next(in, &result);
+    qjson_value_unref(result.value);
+    qjson_ingest_destroy(in);
+    printf("stopped early\n");
+
+    for(int i = 0; i < n; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    rmdir(dir);
+}
+
+void test_compact() {
+    printf("\n\nin [%s]\n", __FUNCTION__);
+
+    /* rows of {"id": i, "name": "a name too long for inline storage", "tags": ["x", "y"], "scores": [..]} */
+    qjson_writer_t w;
+    qjson_writer_init(&w, 0, NULL, NULL);
+    qjson_writer_begin_array(&w);
+    for(int i = 0; i < 100; i++) {
+        qjson_writer_begin_object(&w);
+        qjson_writer_key(&w, "id");
+        qjson_writer_int(&w, i);
+        qjson_writer_key(&w, "name");
+        qjson_writer_string(&w, "a name too long for inline storage");
+        qjson_writer_key(&w, "tags");
+        qjson_writer_begin_array(&w);
+        qjson_writer_string(&w, "x");
+        qjson_writer_string(&w, "y");
+        qjson_writer_end_array(&w);
+        qjson_writer_key(&w, "scores");
+        qjson_writer_begin_array(&w);
+        for(int k = 0; k < 4; k++) {
+            qjson_writer_double(&w, k * 0.5);
+        }
+        qjson_writer_end_array(&w);
+        qjson_writer_end_object(&w);
+    }
+    qjson_writer_end_array(&w);
+    qjson_writer_finish(&w);
+
+    /* the scores are packed so columns are compacted too */
+    qjson_parser_options_t pack = {.flags = QJSON_PARSE_PACK_ARRAYS};
+    qjson_parser_t p;
+    qjson_parser_init(&p, &pack);
+    qjson_value_t *value;
+    qjson_parser_load(&p, qjson_writer_output(&w, NULL), &value, NULL);
+    qjson_parser_release(&p);
+    qjson_cache_enable(value);
+    char *before = qjson_dump_alloc(value, 0, NULL);
+
+    qjson_memory_usage_t usage;
+    qjson_memory_usage(value, &usage);
+    printf("objects %zu, arrays %zu, pairs %zu, items %zu, columns %zu, strings %zu, caches %zu, total %zu\n",
+           usage.objects, usage.arrays, usage.pairs, usage.items, usage.columns, usage.strings, usage.caches, usage.total);
+
+    /* keep one row alive elsewhere: it is shared, so it stays out of the block */
+    qjson_value_t *row = qjson_value_ref(&value->v.array->head.next->value);
+
+    printf("compact: %s\n", qjson_compact(value) == SUCCESS? "ok": "failed");
+    qjson_memory_usage(value, &usage);
+    printf("objects %zu, arrays %zu, pairs %zu, items %zu, columns %zu, strings %zu, caches %zu, total %zu\n",
+           usage.objects, usage.arrays, usage.pairs, usage.items, usage.columns, usage.strings, usage.caches, usage.total);
+    char *after = qjson_dump_alloc(value, 0, NULL);
+    printf("same output: %s, in a block: %s, first row shared: %s\n", strcmp(before, after) == 0? "yes": "no",
+           value->v.array->node.block != NULL? "yes": "no",
+           value->v.array->head.next->value.v.object->node.block == NULL? "yes": "no");
+
+    /* modifying a compacted container copies it out of the block */
+    qjson_value_t *second = qjson_value_at_mut(value, 1);
+    qjson_value_t *id = qjson_value_get_mut(second, "id");
+    id->v.integer = -1;
+    qjson_dump(second, before, strlen(before));
+    printf("modified: %s, still in a block: %s\n", before, second->v.object->node.block != NULL? "yes": "no");
+
+    qjson_value_t *shared = qjson_value_ref(value);
+    printf("compact shared: %s\n", qjson_compact(value) == SUCCESS? "ok": "failed");
+    qjson_value_unref(shared);
+
+    free(before);
+    free(after);
+    qjson_value_unref(row);
+    qjson_value_unref(value);
+    qjson_writer_release(&w);
+}
+
 void test_lld() {
 	printf("sizeof(uint64_t) = %d, sizeof(long long int) = %d, sizeof(long int) = %d\n", sizeof(uint64_t), sizeof(long long int), sizeof(long int));
 }
@@ -969,5 +5632,19 @@ int main() {
     test_dump_object();
 
     test_load_object();
+
+    test_parser_reuse();
+    test_short_strings();
+    test_shared_subtrees();
+    test_dump_parallel();
+    test_incremental_dump();
+    test_validate();
+    test_unicode_escapes();
+    test_lazy_numbers();
+    test_writer();
+    test_packed_arrays();
+    test_schema();
+    test_ingest();
+    test_compact();
     return 0;
 }